@@ -6,6 +6,9 @@
 
 VERSION = 23;
 
+-- Keep song data resident in memory for faster lookups (uses more RAM)
+RESIDENT_SONGS = true;
+
 DB = {
 {
 	name = "Playlists",
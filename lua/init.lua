@@ -1,4 +1,16 @@
 
+-- Seconds to crossfade between queued songs. 0 plays them back to back
+-- without any gap.
+CROSSFADE = 0
+
+-- Upcoming songs in the play queue are downloaded ahead of time
+PREFETCH_SONGS = 3
+PREFETCH_MB = 64
+
+-- Songs can be kept decoded on disk, so playing them again needs no
+-- emulation. Size of the cache in MB; 0 (the default) turns it off.
+SONG_CACHE_MB = 0
+
 -- Given the link to a youtube URL, return an URL to an audio stream
 function on_parse_youtube (url)
 	result = cm_execute(string.format('youtube-dl --skip-download -g "%s"', url))
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace chipmachine {
+
+// Wait-free single producer / single consumer sample ring.
+// The producer (player thread) calls put(), left() and clear(), the consumer
+// (audio callback) calls get(). No locks and no allocation after creation.
+template <typename T> class AudioRing
+{
+public:
+    // Capacity is rounded up to a power of two
+    explicit AudioRing(uint32_t minCapacity)
+    {
+        uint32_t cap = 1;
+        while (cap < minCapacity)
+            cap <<= 1;
+        buffer.resize(cap);
+        mask = cap - 1;
+    }
+
+    AudioRing(AudioRing const&) = delete;
+
+    [[nodiscard]] uint32_t size() const { return mask + 1; }
+
+    // Storage, for locking it into memory
+    [[nodiscard]] T const* data() const { return buffer.data(); }
+
+    // Samples available to the consumer
+    [[nodiscard]] uint32_t filled() const
+    {
+        return writePos.load(std::memory_order_acquire) -
+               readPos.load(std::memory_order_acquire);
+    }
+
+    // Free space as seen by the producer
+    [[nodiscard]] uint32_t left() const { return size() - filled(); }
+
+    // Producer; returns number of samples written
+    uint32_t put(T const* src, uint32_t count)
+    {
+        auto w = writePos.load(std::memory_order_relaxed);
+        auto r = readPos.load(std::memory_order_acquire);
+        count = std::min(count, size() - (w - r));
+        copyIn(w, src, count);
+        writePos.store(w + count, std::memory_order_release);
+        return count;
+    }
+
+    // Consumer; returns number of samples read
+    uint32_t get(T* dst, uint32_t count)
+    {
+        auto r = readPos.load(std::memory_order_relaxed);
+        if (discard.exchange(false, std::memory_order_acquire)) {
+            r = discardPos.load(std::memory_order_relaxed);
+        }
+        auto w = writePos.load(std::memory_order_acquire);
+        count = std::min(count, w - r);
+        copyOut(r, dst, count);
+        readPos.store(r + count, std::memory_order_release);
+        return count;
+    }
+
+    // Producer; drop everything written so far. The consumer skips ahead
+    // on its next get(), so this never touches the read index.
+    void clear()
+    {
+        discardPos.store(writePos.load(std::memory_order_relaxed),
+                         std::memory_order_relaxed);
+        discard.store(true, std::memory_order_release);
+    }
+
+    // Called by the consumer when it could not get a full buffer
+    void underrun() { underruns.fetch_add(1, std::memory_order_relaxed); }
+    [[nodiscard]] uint32_t getUnderruns() const
+    {
+        return underruns.load(std::memory_order_relaxed);
+    }
+
+private:
+    void copyIn(uint32_t pos, T const* src, uint32_t count)
+    {
+        auto i = pos & mask;
+        auto first = std::min(count, size() - i);
+        memcpy(&buffer[i], src, first * sizeof(T));
+        memcpy(&buffer[0], src + first, (count - first) * sizeof(T));
+    }
+
+    void copyOut(uint32_t pos, T* dst, uint32_t count)
+    {
+        auto i = pos & mask;
+        auto first = std::min(count, size() - i);
+        memcpy(dst, &buffer[i], first * sizeof(T));
+        memcpy(dst + first, &buffer[0], (count - first) * sizeof(T));
+    }
+
+    static constexpr size_t CacheLine = 64;
+
+    // Positions run freely and wrap; only the difference matters
+    alignas(CacheLine) std::atomic<uint32_t> writePos{ 0 };
+    std::atomic<uint32_t> discardPos{ 0 };
+    std::atomic<bool> discard{ false };
+    alignas(CacheLine) std::atomic<uint32_t> readPos{ 0 };
+    alignas(CacheLine) std::atomic<uint32_t> underruns{ 0 };
+
+    std::vector<T> buffer;
+    uint32_t mask;
+};
+
+} // namespace chipmachine
@@ -0,0 +1,76 @@
+#include "BufferTuner.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace chipmachine {
+
+// The fill must cover this many of the slowest chunks...
+static constexpr double Safety = 3.0;
+// ...plus the longest the decoder sleeps between refills
+static constexpr double WakeMs = 20.0;
+// Seconds without underruns before the boost is halved
+static constexpr int DecaySeconds = 30;
+
+void BufferTuner::setPlugin(std::string const& plugin)
+{
+    if (plugin == current.plugin) return;
+    std::lock_guard lock{ knownMutex };
+    auto it = known.find(plugin);
+    if (it != known.end()) {
+        current = it->second;
+    } else {
+        current = Stats{};
+        current.plugin = plugin;
+    }
+    cleanFrames = 0;
+}
+
+void BufferTuner::decoded(int frames, int hz, double seconds)
+{
+    if (frames <= 0) return;
+    double ms = seconds * 1000;
+    double audioMs = frames * 1000.0 / hz;
+    current.load = current.load * 0.95 + (ms / audioMs) * 0.05;
+    // Peaks fade over a few hundred chunks so one stall is not forever
+    current.peakMs = std::max(ms, current.peakMs * 0.995);
+
+    cleanFrames += frames;
+    if (cleanFrames > (int64_t)DecaySeconds * hz) {
+        cleanFrames = 0;
+        current.boost = current.boost < 0.1 ? 0 : current.boost / 2;
+    }
+    retarget();
+}
+
+void BufferTuner::underrun()
+{
+    current.underruns++;
+    current.boost = std::min(current.boost + 1, 4.0);
+    cleanFrames = 0;
+    retarget();
+}
+
+void BufferTuner::retarget()
+{
+    double need = std::max<double>(MinMs, Safety * current.peakMs + WakeMs);
+    // A plugin that barely keeps up has no slack to catch up after a stall
+    if (current.load > 0.5) need += (current.load - 0.5) * 1000;
+    need *= 1 + current.boost;
+    current.targetMs = std::clamp((int)std::lround(need), MinMs, MaxMs);
+
+    if (current.plugin.empty()) return;
+    std::lock_guard lock{ knownMutex };
+    known[current.plugin] = current;
+}
+
+std::vector<BufferTuner::Stats> BufferTuner::getStats()
+{
+    std::lock_guard lock{ knownMutex };
+    std::vector<Stats> stats;
+    for (auto const& [name, s] : known)
+        stats.push_back(s);
+    return stats;
+}
+
+} // namespace chipmachine
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace chipmachine {
+
+// Decides how far ahead of playback the decoder keeps the audio ring, per
+// plugin. Cheap plugins get a shallow buffer so songs start and seek
+// quickly; slow or spiky emulators, and plugins that caused underruns, get
+// a deeper one. What is learned is kept for the next song with the same
+// plugin.
+class BufferTuner
+{
+public:
+    // Bounds of the fill target
+    static constexpr int MinMs = 100;
+    static constexpr int MaxMs = 1400;
+    // Frames asked from a plugin per call. Small, so playback starts as
+    // soon as the first chunk is decoded.
+    static constexpr int ChunkFrames = 2048;
+
+    struct Stats
+    {
+        std::string plugin;
+        // Seconds spent decoding per second of audio
+        double load = 0;
+        // Slowest recent chunk
+        double peakMs = 0;
+        int underruns = 0;
+        int targetMs = MinMs;
+        // Extra depth after underruns; decays while playback is clean
+        double boost = 0;
+    };
+
+    // Switch to `plugin`, starting from what was learned about it
+    void setPlugin(std::string const& plugin);
+
+    // A chunk of `frames` at `hz` took `seconds` to decode
+    void decoded(int frames, int hz, double seconds);
+
+    // The audio callback ran out of data
+    void underrun();
+
+    [[nodiscard]] int targetMs() const { return current.targetMs; }
+    [[nodiscard]] Stats const& stats() const { return current; }
+
+    // Every plugin seen so far
+    static std::vector<Stats> getStats();
+
+private:
+    void retarget();
+
+    Stats current;
+    // Frames played since the last underrun or boost decay
+    int64_t cleanFrames = 0;
+
+    static inline std::mutex knownMutex;
+    static inline std::map<std::string, Stats> known;
+};
+
+} // namespace chipmachine
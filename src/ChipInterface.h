@@ -7,6 +7,7 @@
 
 #include <algorithm>
 #include <functional>
+#include <future>
 #include <string>
 #include <vector>
 
@@ -38,11 +39,15 @@ public:
         return 0;
     }
 
-    void addSong(const SongInfo& song) { player.addSong(song); }
-    void nextSong() { player.nextSong(); }
+    // The returned futures are ready once the player has applied the change
+    std::future<void> addSong(const SongInfo& song)
+    {
+        return player.addSong(song);
+    }
+    std::future<void> nextSong() { return player.nextSong(); }
     void clearSongs();
 
-    void setTune(int t) { player.seek(t); }
+    std::future<void> setTune(int t) { return player.seek(t); }
 
     bool playing() { return player.isPlaying(); }
     void pause(bool p) { return player.pause(p); }
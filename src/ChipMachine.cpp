@@ -93,7 +93,7 @@ void ChipMachine::renderSong(grappix::Rectangle const& rec, int y,
 ChipMachine::ChipMachine(utils::path const& wd, RemoteLoader& rl,
                          MusicPlayerList& mpl, MusicDatabase& mdb)
     : workDir(wd), remoteLoader(rl), player(mpl), musicDatabase(mdb),
-      currentScreen(MAIN_SCREEN), eq(SpectrumAnalyzer::eq_slots),
+      currentScreen(MAIN_SCREEN), eq(SpectrumWorker::eq_slots),
       starEffect(screen), scrollEffect(screen)
 {
 
@@ -115,6 +115,15 @@ ChipMachine::ChipMachine(utils::path const& wd, RemoteLoader& rl,
                      });
 
     lua.script_file((workDir / "lua" / "init.lua").string());
+    sol::optional<double> crossfade = lua["CROSSFADE"];
+    if (crossfade) player.setCrossfade(*crossfade);
+    sol::optional<int> prefetchSongs = lua["PREFETCH_SONGS"];
+    sol::optional<int> prefetchMB = lua["PREFETCH_MB"];
+    if (prefetchSongs)
+        player.setPrefetch(*prefetchSongs,
+                           (int64_t)prefetchMB.value_or(64) * 1024 * 1024);
+    sol::optional<int> songCacheMB = lua["SONG_CACHE_MB"];
+    if (songCacheMB) player.setSongCache((int64_t)*songCacheMB * 1024 * 1024);
 
     initYoutube(lua);
 
@@ -357,16 +366,11 @@ void ChipMachine::play(SongInfo const& si)
 
 void ChipMachine::updateFavorite()
 {
-    auto favorites = musicDatabase.getPlaylist(currentPlaylistName);
-    auto favsong =
-        find_if(favorites.begin(), favorites.end(), [&](SongInfo const& song) {
-            return (song.path == currentInfo.path &&
-                    (currentTune == song.starttune ||
-                     (currentTune == currentInfo.starttune &&
-                      song.starttune == -1)));
-        });
-    bool last = isFavorite;
-    isFavorite = (favsong != favorites.end());
+    auto const& path = currentInfo.path;
+    auto const& plist = currentPlaylistName;
+    isFavorite = musicDatabase.playlistContains(plist, path, currentTune) ||
+                 (currentTune == currentInfo.starttune &&
+                  musicDatabase.playlistContains(plist, path, -1));
     uint32_t alpha = isFavorite ? 0xff : 0x00;
     favIcon.color = Color(favColor | (alpha << 24));
     // favIcon.visible(isFavorite);
@@ -445,21 +449,16 @@ void ChipMachine::update()
     }
 
     if (namedToPlay != "") {
-        std::vector<SongInfo> target;
-        SongInfo info;
-        bool random = true;
         if (namedToPlay == "favorites") {
-            target = musicDatabase.getPlaylist("Favorites");
-        } else if (namedToPlay == "all") {
-            musicDatabase.getSongs(target, info, 500, random);
+            for (const auto& s : musicDatabase.getPlaylist("Favorites")) {
+                if (!utils::endsWith(s.path, ".plist")) player.addSong(s);
+            }
         } else {
-            info.path = namedToPlay + "::x";
-            musicDatabase.getSongs(target, info, 500, random);
+            SongInfo info;
+            if (namedToPlay != "all") info.path = namedToPlay + "::x";
+            player.addSongs(musicDatabase.randomSongs(info));
         }
         namedToPlay = "";
-        for (const auto& s : target) {
-            if (!utils::endsWith(s.path, ".plist")) player.addSong(s);
-        }
         player.nextSong();
     }
 
@@ -655,15 +654,17 @@ void ChipMachine::update()
         updateFavorite();
     }
 
-    if (player.isPlaying()) {
+    // One consistent snapshot for the per frame fields
+    auto status = player.getStatus();
+    if (status->playing) {
 
-        auto br = player.getBitrate();
+        auto br = status->bitrate;
         if (br > 0) {
             songField.setText(utils::format("%d KBit", br));
         }
 
-        auto p = player.getPosition();
-        int length = player.getLength();
+        auto p = status->position;
+        int length = status->length;
         timeField.setText(utils::format("%02d:%02d", p / 60, p % 60));
         if (length > 0)
             lengthField.setText(
@@ -671,8 +672,10 @@ void ChipMachine::update()
         else
             lengthField.setText("");
 
-        auto sub_title = player.getMeta("sub_title");
-        if (sub_title != xinfoField.getText()) xinfoField.setText(sub_title);
+        if (status->metaVersion != metaVersion) {
+            metaVersion = status->metaVersion;
+            xinfoField.setText(status->subtitle);
+        }
 
 #ifdef DO_WE_NEED_THIS
         if (scrollText == "") {
@@ -702,20 +705,11 @@ void ChipMachine::update()
     }
 
     if (player.isPlaying()) {
-        auto delay = 1; // AudioPlayer::get_delay();
-        if (fft.size() > delay) {
-            while (fft.size() > delay + 4) {
-                fft.popLevels();
-            }
-            spectrum = fft.getLevels();
-            fft.popLevels();
-        }
+        // Levels are computed off thread; keep the last ones until the
+        // worker has new
+        fft.getLevels(spectrum);
         for (auto i : utils::count_to(fft.eq_slots)) {
-            if (spectrum[i] > 5) {
-                auto f = static_cast<unsigned>(logf(spectrum[i]) * 64);
-                if (f > 255) f = 255;
-                if (f > eq[i]) eq[i] = static_cast<uint8_t>(f);
-            }
+            if (spectrum[i] > eq[i]) eq[i] = spectrum[i];
         }
     }
     bool busy = (
@@ -6,6 +6,7 @@
 #include "MusicDatabase.h"
 #include "MusicPlayerList.h"
 #include "SongInfoField.h"
+#include "SpectrumWorker.h"
 #include "TelnetInterface.h"
 #include "TextField.h"
 #include "state_machine.h"
@@ -15,7 +16,6 @@
 #include "../sol2/sol.hpp"
 
 #include <coreutils/utils.h>
-#include <fft/spectrum.h>
 #include <grappix/grappix.h>
 #include <grappix/gui/list.h>
 #include <grappix/gui/renderset.h>
@@ -120,7 +120,7 @@ public:
     void removeToast();
 
     void setScrolltext(const std::string& txt);
-    void shuffleSongs(int what, int limit);
+    void shuffleSongs(int what);
 
     void shuffleFavorites();
     MusicPlayerList& musicPlayer() { return player; }
@@ -229,8 +229,8 @@ private:
     int spectrumWidth = 24;
     utils::vec2i spectrumPos;
     std::vector<uint8_t> eq;
-    SpectrumAnalyzer fft;
-    std::array<uint16_t, SpectrumAnalyzer::eq_slots> spectrum;
+    SpectrumWorker fft{ MusicPlayer::getOutputHz() };
+    SpectrumWorker::Levels spectrum{};
 
     uint32_t bgcolor = 0;
     bool starsOn = true;
@@ -287,6 +287,8 @@ private:
     SongInfo currentInfo;
     SongInfo dbInfo;
     int currentTune = 0;
+    // MusicPlayerList::Status::metaVersion shown in `xinfoField`
+    uint64_t metaVersion = 0;
 
     tween::Tween currentTween;
     bool isFavorite = false;
@@ -211,22 +211,22 @@ void ChipMachine::setupCommands()
 
     cmd("random_shuffle", [=] {
         toast("Random shuffle!");
-        shuffleSongs(Shuffle::All, 100);
+        shuffleSongs(Shuffle::All);
     });
 
     cmd("composer_shuffle", [=] {
         toast("Composer shuffle!");
-        shuffleSongs(Shuffle::Composer, 1000);
+        shuffleSongs(Shuffle::Composer);
     });
 
     cmd("format_shuffle", [=] {
         toast("Format shuffle!");
-        shuffleSongs(Shuffle::Format, 100);
+        shuffleSongs(Shuffle::Format);
     });
 
     cmd("collection_shuffle", [=] {
         toast("Collection shuffle!");
-        shuffleSongs(Shuffle::Collection, 100);
+        shuffleSongs(Shuffle::Collection);
     });
 
     cmd("favorite_shuffle", [=]() {
@@ -150,9 +150,8 @@ void ChipMachine::shuffleFavorites()
     playSongs(target);
 }
 
-void ChipMachine::shuffleSongs(int what, int limit)
+void ChipMachine::shuffleSongs(int what)
 {
-    std::vector<SongInfo> target;
     SongInfo match =
         (currentScreen == SEARCH_SCREEN) ? getSelectedSong() : dbInfo;
 
@@ -163,8 +162,10 @@ void ChipMachine::shuffleSongs(int what, int limit)
     if (!(what & Shuffle::Collection)) match.path = "";
     match.title = match.game;
 
-    musicDatabase.getSongs(target, match, limit, true);
-    playSongs(target);
+    player.clearSongs();
+    player.addSongs(musicDatabase.randomSongs(match));
+    showScreen(MAIN_SCREEN);
+    player.nextSong();
 }
 
 void ChipMachine::playSongs(std::vector<SongInfo> const& songs)
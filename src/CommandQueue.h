@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+
+namespace chipmachine {
+
+// Multi producer, single consumer queue of commands. push() is lock free
+// (apart from the wakeup); the consumer thread calls run() and waitFor().
+class CommandQueue
+{
+public:
+    using Command = std::function<void()>;
+
+    CommandQueue() = default;
+    CommandQueue(CommandQueue const&) = delete;
+
+    ~CommandQueue()
+    {
+        auto* n = tail->next.load();
+        if (tail != &stub) delete tail;
+        while (n != nullptr) {
+            auto* next = n->next.load();
+            delete n;
+            n = next;
+        }
+    }
+
+    // Any thread
+    void push(Command cmd)
+    {
+        auto* n = new Node{ std::move(cmd) };
+        auto* prev = head.exchange(n, std::memory_order_acq_rel);
+        prev->next.store(n, std::memory_order_release);
+        // Taking the lock makes sure the consumer is either waiting or has
+        // not yet checked for commands, so the notify can not be lost
+        { std::lock_guard lock{ wakeMutex }; }
+        wakeCond.notify_one();
+    }
+
+    // Consumer; run all queued commands in order. Returns number run.
+    int run()
+    {
+        int count = 0;
+        while (auto* next = tail->next.load(std::memory_order_acquire)) {
+            // `tail` is always an already consumed node
+            auto cmd = std::move(next->cmd);
+            if (tail != &stub) delete tail;
+            tail = next;
+            cmd();
+            count++;
+        }
+        return count;
+    }
+
+    // Consumer; sleep until a command is pushed, wake() is called or the
+    // timeout expires
+    template <typename Rep, typename Period>
+    void waitFor(std::chrono::duration<Rep, Period> timeout)
+    {
+        std::unique_lock lock{ wakeMutex };
+        wakeCond.wait_for(lock, timeout, [this] {
+            return woken || tail->next.load(std::memory_order_acquire);
+        });
+        woken = false;
+    }
+
+    void wake()
+    {
+        {
+            std::lock_guard lock{ wakeMutex };
+            woken = true;
+        }
+        wakeCond.notify_one();
+    }
+
+private:
+    struct Node
+    {
+        Command cmd;
+        std::atomic<Node*> next{ nullptr };
+    };
+
+    Node stub;
+    // Producers append at `head`, the consumer follows `tail`
+    std::atomic<Node*> head{ &stub };
+    Node* tail = &stub;
+
+    std::mutex wakeMutex;
+    std::condition_variable wakeCond;
+    bool woken = false;
+};
+
+} // namespace chipmachine
@@ -1,72 +1,71 @@
 #include "GZPlugin.h"
+#include "MemFile.h"
+#include "PluginRegistry.h"
 
-#include <coreutils/file.h>
 #include <coreutils/log.h>
+#include <coreutils/utils.h>
+
 #include <cstdio>
+#include <cstring>
 #include <zlib.h>
 
 namespace chipmachine {
 
-int static inflate(const char* infile, const char* outfile)
+// Unpack a gzip file into memory; empty on error
+static std::vector<uint8_t> gunzip(std::string const& fileName)
 {
-    int ret;
-    uint8_t in[32768];
-    uint8_t out[32768];
+    std::vector<uint8_t> result;
+    FILE* fp = fopen(fileName.c_str(), "rb");
+    if (fp == nullptr) return result;
 
     z_stream strm;
     memset(&strm, 0, sizeof(strm));
-    ret = inflateInit2(&strm, 16 + MAX_WBITS);
-    if (ret != Z_OK) return ret;
-    FILE* fp = fopen(infile, "rb");
-    FILE* fpo = fopen(outfile, "wb");
-    /* decompriiiess until deflate stream ends or end of file */
-    do {
+    if (inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK) {
+        fclose(fp);
+        return result;
+    }
+    uint8_t in[32768];
+    int ret = Z_OK;
+    while (ret != Z_STREAM_END) {
         strm.avail_in = fread(in, 1, sizeof(in), fp);
-        if (ferror(fp)) {
-            fclose(fp);
-            fclose(fpo);
-            (void)inflateEnd(&strm);
-            return Z_ERRNO;
-        }
-        if (strm.avail_in == 0) break;
+        if (ferror(fp) || strm.avail_in == 0) break;
         strm.next_in = in;
-
-        /* run inflate() on input until output buffer not full */
+        // Inflate until the input is used up
         do {
-            strm.avail_out = sizeof(out);
-            strm.next_out = out;
+            size_t done = result.size();
+            result.resize(done + 65536);
+            strm.avail_out = 65536;
+            strm.next_out = &result[done];
             ret = inflate(&strm, Z_NO_FLUSH);
-            // assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
+            result.resize(done + 65536 - strm.avail_out);
             if (ret == Z_NEED_DICT) ret = Z_DATA_ERROR;
-            if (ret <= Z_DATA_ERROR) {
-                (void)inflateEnd(&strm);
-                return ret;
-            }
-
-            int have = sizeof(out) - strm.avail_out;
-            if ((int)fwrite(out, 1, have, fpo) != have || ferror(fpo)) {
-                fclose(fpo);
-                (void)inflateEnd(&strm);
-                return Z_ERRNO;
-            }
-        } while (strm.avail_out == 0);
-    } while (ret != Z_STREAM_END);
+        } while (ret >= Z_OK && ret != Z_STREAM_END && strm.avail_out == 0);
+        if (ret < Z_OK) break;
+    }
     fclose(fp);
-    fclose(fpo);
     (void)inflateEnd(&strm);
-    return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
+    if (ret != Z_STREAM_END) result.clear();
+    return result;
 }
 
 musix::ChipPlayer* GZPlugin::fromFile(const std::string& fileName)
 {
-    /* done when inflate() says it's done */
-    auto outFile = fileName.substr(0, fileName.length() - 3);
-    int rc = inflate(fileName.c_str(), outFile.c_str());
-    LOGD("Trying to gunzip %s to %s = %d", fileName, outFile, rc);
+    auto data = gunzip(fileName);
+    auto name = utils::path_filename(fileName);
+    name = name.substr(0, name.length() - 3);
+    LOGD("Unpacked %s to %d bytes", fileName, (int)data.size());
+    if (data.empty()) return nullptr;
+    auto file = std::make_shared<MemFile>(name, data);
+    if (!*file) return nullptr;
 
-    for (auto plugin : plugins) {
-        if (plugin->canHandle(outFile)) {
-            return plugin->fromFile(outFile);
+    for (auto const& plugin : PluginRegistry::candidates(file->path())) {
+        if (plugin.get() == this) continue;
+        if (auto* player = plugin->fromFile(file->path())) {
+            // Some plugins read the file later, so keep the last few
+            std::lock_guard lock{ filesMutex };
+            files.push_back(file);
+            if (files.size() > KeepFiles) files.pop_front();
+            return player;
         }
     }
     LOGD("No plugin could handle it");
@@ -2,15 +2,18 @@
 
 #include <musicplayer/chipplugin.h>
 
+#include <deque>
+#include <memory>
+#include <mutex>
+
 namespace chipmachine {
 
+class MemFile;
+
 class GZPlugin : public musix::ChipPlugin
 {
 public:
     GZPlugin() = default;
-    explicit GZPlugin(std::vector<std::shared_ptr<musix::ChipPlugin>>& plugins)
-        : plugins(plugins)
-    {}
     [[nodiscard]] virtual std::string name() const override
     {
         return "GZPlugin";
@@ -20,7 +23,9 @@ public:
     bool canHandle(const std::string& name) override;
 
 private:
-    std::vector<std::shared_ptr<musix::ChipPlugin>> plugins;
+    static constexpr size_t KeepFiles = 16;
+    std::mutex filesMutex;
+    std::deque<std::shared_ptr<MemFile>> files;
 };
 
 } // namespace chipmachine
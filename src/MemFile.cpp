@@ -0,0 +1,91 @@
+#include "MemFile.h"
+
+#include <coreutils/environment.h>
+#include <coreutils/log.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+
+#ifdef __linux__
+#    include <cerrno>
+#    include <csignal>
+#    include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace chipmachine {
+
+static constexpr char Prefix[] = "chipmachine-";
+
+fs::path MemFile::root()
+{
+    static fs::path const dir = [] {
+        std::error_code ec;
+#ifdef __linux__
+        if (fs::is_directory("/dev/shm", ec)) {
+            removeStale();
+            return fs::path("/dev/shm") /
+                   (Prefix + std::to_string(getpid()));
+        }
+#endif
+        return Environment::getCacheDir() / "_tmp";
+    }();
+    // Remove what is left at exit
+    static struct Cleanup
+    {
+        ~Cleanup()
+        {
+            std::error_code ec;
+            fs::remove_all(dir, ec);
+        }
+    } cleanup;
+    return dir;
+}
+
+void MemFile::removeStale()
+{
+#ifdef __linux__
+    std::error_code ec;
+    for (auto const& e : fs::directory_iterator("/dev/shm", ec)) {
+        auto name = e.path().filename().string();
+        if (name.rfind(Prefix, 0) != 0) continue;
+        auto pid = (pid_t)std::atoi(name.c_str() + sizeof(Prefix) - 1);
+        if (pid <= 0 || pid == getpid()) continue;
+        // EPERM means it is alive but someone else's
+        if (kill(pid, 0) == 0 || errno != ESRCH) continue;
+        LOGD("Removing %s left by an earlier run", e.path().string());
+        std::error_code removeEc;
+        fs::remove_all(e.path(), removeEc);
+    }
+#endif
+}
+
+MemFile::MemFile()
+{
+    static std::atomic<int> counter{ 0 };
+    fileDir = root() / std::to_string(counter++);
+    std::error_code ec;
+    fs::remove_all(fileDir, ec);
+    ok = fs::create_directories(fileDir, ec);
+    if (!ok) LOGE("Could not create %s", fileDir.string());
+}
+
+MemFile::MemFile(std::string const& name, std::vector<uint8_t> const& data)
+    : MemFile()
+{
+    if (!ok) return;
+    fileName = (fileDir / name).string();
+    std::ofstream out(fileName, std::ios::binary);
+    out.write((char const*)data.data(), data.size());
+    ok = (bool)out;
+}
+
+MemFile::~MemFile()
+{
+    std::error_code ec;
+    fs::remove_all(fileDir, ec);
+}
+
+} // namespace chipmachine
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace chipmachine {
+
+// A file for plugins that can only open files by name, kept in memory
+// where the platform allows it (tmpfs on Linux) so unpacking songs does
+// not write to disk. Each MemFile has a directory of its own, so the
+// file keeps its original name; it is removed when the MemFile goes.
+class MemFile
+{
+public:
+    // Only the directory; for archives that extract by themselves
+    MemFile();
+    MemFile(std::string const& name, std::vector<uint8_t> const& data);
+    ~MemFile();
+    MemFile(MemFile const&) = delete;
+    MemFile& operator=(MemFile const&) = delete;
+
+    explicit operator bool() const { return ok; }
+
+    [[nodiscard]] std::filesystem::path const& dir() const { return fileDir; }
+    [[nodiscard]] std::string path() const { return fileName; }
+
+    // Where the directories are created; memory backed if possible
+    static std::filesystem::path root();
+
+    // Remove what runs that crashed or were killed left behind in tmpfs,
+    // as it would take up memory until reboot. Done by root() on first use.
+    static void removeStale();
+
+private:
+    std::filesystem::path fileDir;
+    std::string fileName;
+    bool ok = false;
+};
+
+} // namespace chipmachine
@@ -13,7 +13,11 @@
 
 #include <algorithm>
 #include <chrono>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
 #include <map>
+#include <random>
 #include <set>
 
 #include <sol.hpp>
@@ -74,6 +78,12 @@ void MusicDatabase::createTables()
             "screenshots STRING, collection INTEGER, metadata STRING)");
     db.exec("CREATE TABLE IF NOT EXISTS prod2song (songid INTEGER, prodid "
             "INTEGER)");
+    // Used by path lookups when songs are not resident
+    db.exec("CREATE INDEX IF NOT EXISTS song_path ON song (path)");
+    db.exec("CREATE INDEX IF NOT EXISTS prod2song_song ON prod2song (songid)");
+    // Not part of the collections, so kept when they are rebuilt
+    db.exec("CREATE TABLE IF NOT EXISTS analysis (path STRING, tune INTEGER, "
+            "tunes INTEGER, length INTEGER, PRIMARY KEY (path, tune))");
 }
 
 bool MusicDatabase::parseBitworld(
@@ -615,10 +625,9 @@ void MusicDatabase::setFilter(std::string const& collection, int type)
         collectionFilter = -1;
     } else {
         LOGD("FILTER: '%s'", collection);
-        auto cq = db.query<int>("SELECT ROWID FROM collection WHERE id = ?",
-                                collection);
-        if (cq.step()) {
-            collectionFilter = cq.get();
+        auto it = collectionRows.find(collection);
+        if (it != collectionRows.end()) {
+            collectionFilter = it->second;
             LOGD("ID %d from %s", collectionFilter, collection);
             // collectionFilter = 2;
             titleIndex.setFilter([=](int index) {
@@ -652,6 +661,9 @@ int MusicDatabase::search(std::string const& query, std::vector<int>& result,
         for (int i = 0; i < playLists.size(); i++) {
             result.push_back(PLAYLIST_INDEX + i);
         }
+        for (int i = 0; i < smartLists.size(); i++) {
+            result.push_back(SMARTLIST_INDEX + i);
+        }
         return result.size();
     }
 
@@ -660,6 +672,10 @@ int MusicDatabase::search(std::string const& query, std::vector<int>& result,
         if (toLower(playLists[i].name).find(query) != std::string::npos)
             result.push_back(PLAYLIST_INDEX + i);
     }
+    for (int i = 0; i < smartLists.size(); i++) {
+        if (toLower(smartLists[i].name).find(query) != std::string::npos)
+            result.push_back(SMARTLIST_INDEX + i);
+    }
 
     titleIndex.search(title_query, result, searchLimit);
 
@@ -688,8 +704,19 @@ int MusicDatabase::search(std::string const& query, std::vector<int>& result,
 // Lookup the given path in the database
 SongInfo& MusicDatabase::lookup(SongInfo& song)
 {
+    std::lock_guard lock{ dbMutex };
+    return resolve(song);
+}
 
+void MusicDatabase::lookup(std::vector<SongInfo>& songs)
+{
     std::lock_guard lock{ dbMutex };
+    for (auto& song : songs)
+        resolve(song);
+}
+
+SongInfo& MusicDatabase::resolve(SongInfo& song)
+{
     auto path = song.path;
 
     std::vector<std::string> parts = split(path, "::");
@@ -697,7 +724,7 @@ SongInfo& MusicDatabase::lookup(SongInfo& song)
         path = parts[1];
         if (parts[0] == "index") {
             int index = stol(path);
-            SongInfo song = getSongInfo(index);
+            SongInfo song = songInfo(index);
             path = song.path;
             parts = split(path, "::");
             if (parts.size() > 1) {
@@ -707,18 +734,34 @@ SongInfo& MusicDatabase::lookup(SongInfo& song)
         LOGD("INDEX %s %s", parts[0], path);
     }
 
-    auto q = db.query<std::string, std::string, std::string, std::string,
-                      std::string, std::string, std::string>(
-        "SELECT path, title, game, composer, format, collection.id, metadata "
-        "FROM song, collection "
-        "WHERE song.collection = collection.ROWID AND song.path = ?",
-        path);
+    if (songStore.size() > 0) {
+        auto index = songStore.findPath(path);
+        if (index >= 0) {
+            auto s = storedSong(index);
+            song.path = s.path;
+            song.title = s.title;
+            song.game = s.game;
+            song.composer = s.composer;
+            song.format = s.format;
+            song.metadata[SongInfo::INFO] = s.metadata[SongInfo::INFO];
+            LOGD("LOOKUP '%s' became '%s'", path, song.path);
+        } else {
+            LOGD("TODO: Check products");
+        }
+        return song;
+    }
+
+    auto& q = statement<std::string, std::string, std::string, std::string,
+                        std::string, int, std::string>(
+        "SELECT path, title, game, composer, format, collection, metadata "
+        "FROM song WHERE path = ?");
+    q.bind(path);
 
     if (q.step()) {
-        std::string coll;
+        int coll;
         tie(song.path, song.title, song.game, song.composer, song.format, coll,
             song.metadata[SongInfo::INFO]) = q.get_tuple();
-        song.path = coll + "::" + song.path;
+        song.path = collectionName(coll) + "::" + song.path;
         LOGD("LOOKUP '%s' became '%s'", path, song.path);
     } else {
         LOGD("TODO: Check products");
@@ -727,19 +770,28 @@ SongInfo& MusicDatabase::lookup(SongInfo& song)
     return song;
 }
 
-std::string MusicDatabase::getScreenshotURL(std::string const& collection)
+std::string MusicDatabase::getScreenshotURL(std::string const& collection) const
 {
-    std::string prefix;
-    auto q = db.query<std::string>("SELECT url FROM collection WHERE id = ?",
-                                   collection);
-    if (q.step()) prefix = q.get();
-    return prefix;
+    auto it = collectionRows.find(collection);
+    if (it == collectionRows.end()) return "";
+    return collections[it->second].url;
 }
 
 // Get SongInfo from the search result
 SongInfo MusicDatabase::getSongInfo(int index) const
+{
+    std::lock_guard lock{ dbMutex };
+    return songInfo(index);
+}
+
+SongInfo MusicDatabase::songInfo(int index) const
 {
 
+    if (index >= SMARTLIST_INDEX) {
+        std::string p = smartLists[index - SMARTLIST_INDEX].name;
+        return SongInfo("smart::" + p, "", p, "", "Smart playlist");
+    }
+
     if (index >= PLAYLIST_INDEX) {
         std::string p = playLists[index - PLAYLIST_INDEX].name;
         auto path = Environment::getConfigDir() / "playlists" / p;
@@ -751,45 +803,64 @@ SongInfo MusicDatabase::getSongInfo(int index) const
     // LOGD("ID %d vs PROD %d", index, productStartIndex);
     if (index >= productStartIndex) {
         index -= productStartIndex;
-        auto q = db.query<std::string, std::string, std::string, std::string,
-                          std::string>(
-            "SELECT title, creator, type, collection.id, metadata "
-            "FROM  product, collection "
-            "WHERE product.ROWID = ? AND product.collection = collection.ROWID",
-            index);
+        auto& q = statement<std::string, std::string, std::string, int,
+                            std::string>(
+            "SELECT title, creator, type, collection, metadata "
+            "FROM product WHERE ROWID = ?");
+        q.bind(index);
         if (q.step()) {
             SongInfo song;
-            std::string collection;
+            int collection;
             tie(song.title, song.composer, song.format, collection,
                 song.metadata[SongInfo::INFO]) = q.get_tuple();
             song.path = "product::" + std::to_string(index);
             return song;
         }
 
+    } else if (index <= (int)songStore.size()) {
+        return storedSong(index - 1);
     } else {
 
-        auto q = db.query<std::string, std::string, std::string, std::string,
-                          std::string, std::string, std::string>(
-            "SELECT title, game, composer, format, song.path, "
-            "collection.id, metadata "
-            "FROM song, collection "
-            "WHERE song.ROWID = ? AND song.collection = collection.ROWID",
-            index);
+        auto& q = statement<std::string, std::string, std::string, std::string,
+                            std::string, int, std::string>(
+            "SELECT title, game, composer, format, path, collection, "
+            "metadata FROM song WHERE ROWID = ?");
+        q.bind(index);
         if (q.step()) {
             SongInfo song;
-            std::string collection;
+            int collection;
             tie(song.title, song.game, song.composer, song.format, song.path,
                 collection, song.metadata[SongInfo::INFO]) = q.get_tuple();
-            song.path = collection + "::" + song.path;
+            song.path = collectionName(collection) + "::" + song.path;
             return song;
         }
     }
     throw not_found_exception();
 }
+SongInfo MusicDatabase::storedSong(uint32_t index, bool withMetadata) const
+{
+    auto s = songStore.get(index);
+    SongInfo song;
+    song.path = collectionName(s.collection) + "::" + std::string(s.path);
+    song.game = s.game;
+    song.title = s.title;
+    song.composer = s.composer;
+    song.format = s.format;
+    // Metadata is rare and can be large, so it stays in the database
+    if (withMetadata && s.hasMetadata) {
+        auto& q =
+            statement<std::string>("SELECT metadata FROM song WHERE ROWID = ?");
+        q.bind(index + 1);
+        if (q.step()) song.metadata[SongInfo::INFO] = q.get();
+    }
+    return song;
+}
+
 std::string MusicDatabase::getSongScreenshots(SongInfo& s)
 {
 
     lookup(s);
+    std::lock_guard lock{ dbMutex };
     auto parts = split(s.path, "::");
     LOGD(s.path);
     if (parts.size() < 2) return "";
@@ -812,21 +883,27 @@ std::string MusicDatabase::getSongScreenshots(SongInfo& s)
         s.metadata[SongInfo::SCREENSHOT] = shot;
         s.metadata[SongInfo::INFO] = "";
         LOGD("Got pouet shot %s", shot);
+    } else if (songStore.size() > 0) {
+        // Already resolved to full URLs when the store was built
+        auto index = songStore.findPath(parts[1]);
+        if (index >= 0) return std::string(songStore.screenshots(index));
+        return "";
     } else {
-        auto q = db.query<std::string, std::string, std::string, std::string>(
+        auto& q = statement<std::string, std::string, std::string, int>(
             "SELECT product.title, product.screenshots, product.type, "
-            "collection.id "
-            "FROM product, prod2song, song, collection "
+            "product.collection "
+            "FROM product, prod2song, song "
             "WHERE product.rowid = prod2song.prodid AND prod2song.songid = "
-            "song.ROWID AND "
-            "product.collection = collection.ROWID AND song.path = ?",
-            parts[1]);
+            "song.ROWID AND song.path = ?");
+        q.bind(parts[1]);
         std::string format;
         int lowestDist = 999999;
         collection = "";
         while (q.step()) {
-            std::string s, c;
-            tie(title, s, format, c) = q.get_tuple();
+            std::string s;
+            int crow;
+            tie(title, s, format, crow) = q.get_tuple();
+            auto const& c = collectionName(crow);
             LOGD("%s Collection %s Format %s", title, c, format);
             auto ld = levenshteinDistance(title, baseName);
             if (collection == "gb64" && c == "csdb") ld += 7;
@@ -841,36 +918,40 @@ std::string MusicDatabase::getSongScreenshots(SongInfo& s)
             // format.find("Trackmo") != std::string::npos)     break;
         }
     }
-    if (shot != "") {
-        std::string prefix;
-        if (!startsWith(shot, "http")) prefix = getScreenshotURL(collection);
-        std::vector<std::string> parts = split(shot, ";");
-        if (collection == "gb64")
-            parts.insert(parts.begin(), path_directory(parts[0]) + "/" +
-                                            path_basename(parts[0]) + "_1." +
-                                            path_extension(parts[0]));
-        for (auto& p : parts) {
-            if (p != "") p.insert(0, prefix);
-        }
-        shot = join(parts.begin(), parts.end(), ";");
+    return resolveScreenshots(shot, collection);
+}
+
+// Turn a product screenshot list into full URLs
+std::string
+MusicDatabase::resolveScreenshots(std::string const& shot,
+                                  std::string const& collection) const
+{
+    if (shot == "") return shot;
+    std::string prefix;
+    if (!startsWith(shot, "http")) prefix = getScreenshotURL(collection);
+    std::vector<std::string> parts = split(shot, ";");
+    if (collection == "gb64")
+        parts.insert(parts.begin(), path_directory(parts[0]) + "/" +
+                                        path_basename(parts[0]) + "_1." +
+                                        path_extension(parts[0]));
+    for (auto& p : parts) {
+        if (p != "") p.insert(0, prefix);
     }
-    return shot;
+    return join(parts.begin(), parts.end(), ";");
 }
 
 std::string MusicDatabase::getProductScreenshots(uint32_t id)
 {
-    std::vector<std::string> shots;
-    auto q = db.query<std::string, std::string>(
-        "SELECT collection.id,screenshots "
-        "FROM product, collection "
-        "WHERE product.rowid = ? AND collection.ROWID = product.collection",
-        id);
+    auto& q = statement<int, std::string>(
+        "SELECT collection, screenshots FROM product WHERE ROWID = ?");
+    q.bind(id);
 
     std::string screenshot;
-    std::string collection;
+    int crow;
 
     if (q.step()) {
-        tie(collection, screenshot) = q.get_tuple();
+        tie(crow, screenshot) = q.get_tuple();
+        auto const& collection = collectionName(crow);
         auto prefix = getScreenshotURL(collection);
         std::vector<std::string> parts = split(screenshot, ";");
         if (collection == "gb64")
@@ -886,23 +967,30 @@ std::string MusicDatabase::getProductScreenshots(uint32_t id)
 
 std::vector<SongInfo> MusicDatabase::getProductSongs(uint32_t id)
 {
+    std::lock_guard lock{ dbMutex };
     std::vector<SongInfo> songs;
     auto screenshot = getProductScreenshots(id);
-    auto q = db.query<std::string, std::string, std::string, std::string,
-                      std::string, std::string, std::string>(
-        "SELECT title, game, composer, format, song.path, collection.id, "
+    if (songStore.size() > 0) {
+        songStore.forProductSongs(id, [&](uint32_t index) {
+            songs.push_back(storedSong(index));
+            songs.back().metadata[SongInfo::SCREENSHOT] = screenshot;
+        });
+        return songs;
+    }
+    auto& q = statement<std::string, std::string, std::string, std::string,
+                        std::string, int, std::string>(
+        "SELECT title, game, composer, format, song.path, song.collection, "
         "metadata "
-        "FROM song, prod2song, collection "
-        "WHERE prodid = ? AND songid = song.ROWID AND song.collection = "
-        "collection.ROWID",
-        id);
+        "FROM song, prod2song "
+        "WHERE prodid = ? AND songid = song.ROWID");
+    q.bind(id);
 
     while (q.step()) {
         SongInfo song;
-        std::string collection;
+        int collection;
         tie(song.title, song.game, song.composer, song.format, song.path,
             collection, song.metadata[SongInfo::INFO]) = q.get_tuple();
-        song.path = collection + "::" + song.path;
+        song.path = collectionName(collection) + "::" + song.path;
         song.metadata[SongInfo::SCREENSHOT] = screenshot;
         songs.push_back(song);
     }
@@ -1034,23 +1122,36 @@ void MusicDatabase::writeIndex(apone::File&& f)
     f.close();
 }
 
-void MusicDatabase::generateIndex()
+void MusicDatabase::loadCollections()
 {
-
-    // std::lock_guard lock{dbMutex};
-
-    RemoteLoader& loader = remoteLoader;
+    collections.clear();
+    collectionRows.clear();
     auto q = db.query<int, std::string, std::string, std::string>(
         "SELECT ROWID,id,url,localdir FROM collection");
     while (q.step()) {
         auto c = q.get<Collection>();
+        if (c.id >= (int)collections.size()) collections.resize(c.id + 1);
+        collectionRows[c.name] = c.id;
+        collections[c.id] = c;
+    }
+}
+
+void MusicDatabase::generateIndex()
+{
+
+    // std::lock_guard lock{dbMutex};
+
+    loadCollections();
+    for (auto const& c : collections) {
+        if (c.id < 0) continue;
         // NOTE c.name is really c.id
-        loader.registerSource(c.name, c.url, c.local_dir.string());
+        remoteLoader.registerSource(c.name, c.url, c.local_dir.string());
     }
     auto indexPath = Environment::getCacheDir() / "index.dat";
 
     if (!reindexNeeded && utils::exists(indexPath)) {
         readIndex(apone::File{ indexPath });
+        loadSongStore();
         return;
     }
 
@@ -1173,10 +1274,87 @@ void MusicDatabase::generateIndex()
     }
 
     writeIndex(apone::File{ indexPath, apone::File::Write });
+    loadSongStore();
 
     reindexNeeded = false;
 }
 
+void MusicDatabase::loadSongStore()
+{
+    songStore.clear();
+    if (!residentSongs) return;
+
+    auto storePath = Environment::getCacheDir() / "songs.dat";
+    if (!reindexNeeded && utils::exists(storePath)) {
+        apone::File f{ storePath };
+        if (songStore.load(f, dbVersion) &&
+            songStore.size() == productStartIndex)
+            return;
+        songStore.clear();
+    }
+
+    LOGD("Creating resident song table");
+    songStore.reserve(productStartIndex);
+
+    auto q = db.query<std::string, std::string, std::string, std::string,
+                      std::string, int, int>(
+        "SELECT path, game, title, composer, format, collection, "
+        "metadata IS NOT NULL AND metadata != '' FROM song ORDER BY ROWID");
+    std::string path, game, title, composer, fmt;
+    int collection, hasMeta;
+    while (q.step()) {
+        tie(path, game, title, composer, fmt, collection, hasMeta) =
+            q.get_tuple();
+        songStore.add(path, game, title, composer, fmt, collection,
+                      hasMeta != 0);
+    }
+
+    auto pq = db.query<uint32_t, uint32_t>(
+        "SELECT prodid, songid FROM prod2song ORDER BY prodid");
+    while (pq.step()) {
+        uint32_t prod, song;
+        tie(prod, song) = pq.get_tuple();
+        songStore.addProductSong(prod, song);
+    }
+
+    // Pick the product that best matches each song (by title vs file name)
+    // so screenshot lookup during playback is a single array access
+    std::vector<size_t> bestDist(songStore.size(), SIZE_MAX);
+    std::vector<uint8_t> bestIsGb64(songStore.size(), 0);
+    std::vector<std::string> baseNames(songStore.size());
+    auto shq = db.query<uint32_t, std::string, std::string, int>(
+        "SELECT ROWID, title, screenshots, collection FROM product");
+    std::string shots;
+    uint32_t prod;
+    while (shq.step()) {
+        tie(prod, title, shots, collection) = shq.get_tuple();
+        auto const& cname = collectionName(collection);
+        int64_t shotId = -1;
+        songStore.forProductSongs(prod, [&](uint32_t i) {
+            auto& baseName = baseNames[i];
+            if (baseName.empty())
+                baseName = path_basename(std::string(songStore.get(i).path));
+            auto ld = levenshteinDistance(title, baseName);
+            if (bestIsGb64[i] && cname == "csdb") ld += 7;
+            if (ld < bestDist[i]) {
+                if (shotId < 0) {
+                    shotId = songStore.addScreenshots(
+                        resolveScreenshots(shots, cname));
+                }
+                songStore.setScreenshots(i, shotId);
+                bestDist[i] = ld;
+                bestIsGb64[i] = cname == "gb64";
+            }
+        });
+    }
+
+    songStore.finish();
+
+    apone::File f{ storePath, apone::File::Write };
+    songStore.dump(f, dbVersion);
+    f.close();
+}
+
 void MusicDatabase::initFromLuaAsync(utils::path const& workDir)
 {
     indexing = true;
@@ -1204,6 +1382,12 @@ bool MusicDatabase::initFromLua(utils::path const& workDir)
         playLists.back().save();
     }
 
+    auto smartPath = Environment::getConfigDir() / "smartlists";
+    utils::create_directory(smartPath);
+    for (auto const& f : utils::File{ smartPath }.listFiles()) {
+        smartLists.emplace_back(f.getName());
+    }
+
     reindexNeeded = false;
     auto indexDir = Environment::getCacheDir() / "index.dat";
 
@@ -1235,7 +1419,11 @@ bool MusicDatabase::initFromLua(utils::path const& workDir)
 
     dbVersion = lua["VERSION"];
     LOGD("DBVERSION %d INDEXVERSION %d", dbVersion, indexVersion);
+    sol::optional<bool> resident = lua["RESIDENT_SONGS"];
+    if (resident) residentSongs = *resident;
     if (dbVersion != indexVersion) {
+        // Cached statements would keep the old tables locked
+        statements.clear();
         db.exec("DROP TABLE IF EXISTS collection");
         db.exec("DROP TABLE IF EXISTS song");
         db.exec("DROP TABLE IF EXISTS product");
@@ -1255,6 +1443,7 @@ bool MusicDatabase::initFromLua(utils::path const& workDir)
         end
     )");
     generateIndex();
+    loadHistory();
     return true;
 }
 
@@ -1263,6 +1452,10 @@ int MusicDatabase::getSongs(std::vector<SongInfo>& target,
 {
 
     std::lock_guard lock{ dbMutex };
+
+    if (songStore.size() > 0)
+        return getStoredSongs(target, match, limit, random);
+
     std::string txt =
         "SELECT path, game, title, composer, format, collection.id "
         "FROM song, collection "
@@ -1302,13 +1495,423 @@ int MusicDatabase::getSongs(std::vector<SongInfo>& target,
     return 0;
 }
 
+int MusicDatabase::getStoredSongs(std::vector<SongInfo>& target,
+                                  SongInfo const& match, int limit,
+                                  bool random)
+{
+    static constexpr int64_t ANY = -2;
+    int64_t format = ANY;
+    int64_t composer = ANY;
+    int collection = -1;
+
+    if (match.format != "") format = songStore.findString(match.format);
+    if (match.composer != "") composer = songStore.findString(match.composer);
+    if (match.path != "") {
+        auto parts = split(match.path, "::");
+        if (parts.size() >= 2) {
+            auto it = collectionRows.find(parts[0]);
+            if (it == collectionRows.end()) return 0;
+            collection = it->second;
+        }
+    }
+    // Asked for a format or composer that does not exist
+    if (format == -1 || composer == -1) return 0;
+
+    std::vector<uint32_t> hits;
+    for (uint32_t i = 0; i < songStore.size(); i++) {
+        if (format != ANY && songStore.formatId(i) != format) continue;
+        if (composer != ANY && songStore.composerId(i) != composer) continue;
+        if (collection >= 0 && songStore.collectionOf(i) != collection)
+            continue;
+        hits.push_back(i);
+    }
+
+    if (random) {
+        static std::mt19937 rng{ std::random_device{}() };
+        std::shuffle(hits.begin(), hits.end(), rng);
+    }
+    if (limit > 0 && (int)hits.size() > limit) hits.resize(limit);
+
+    for (auto i : hits) {
+        auto song = storedSong(i, false);
+        if (song.game != "")
+            song.title = utils::format("%s [%s]", song.game, song.title);
+        target.push_back(song);
+    }
+    return 0;
+}
+
+MusicDatabase::SongSource MusicDatabase::randomSongs(SongInfo const& match)
+{
+    if (songStore.size() == 0 && (match.format != "" || match.composer != "")) {
+        // Can only filter on those with resident songs, fall back to SQL
+        auto songs = std::make_shared<std::vector<SongInfo>>();
+        getSongs(*songs, match, 500, true);
+        return [songs, i = size_t{ 0 }](SongInfo& song) mutable {
+            if (i >= songs->size()) return false;
+            song = (*songs)[i++];
+            return true;
+        };
+    }
+
+    std::lock_guard lock{ dbMutex };
+
+    static constexpr int64_t ANY = -2;
+    int64_t format = ANY;
+    int64_t composer = ANY;
+    int collection = -1;
+
+    if (match.format != "") format = songStore.findString(match.format);
+    if (match.composer != "") composer = songStore.findString(match.composer);
+    if (match.path != "") {
+        auto parts = split(match.path, "::");
+        if (parts.size() >= 2) {
+            auto it = collectionRows.find(parts[0]);
+            collection = it != collectionRows.end() ? it->second : 0;
+        }
+    }
+
+    struct Shuffle
+    {
+        std::vector<uint32_t> songs;
+        size_t pos = 0;
+        std::mt19937 rng{ std::random_device{}() };
+    };
+    auto shuffle = std::make_shared<Shuffle>();
+
+    if (format != -1 && composer != -1) {
+        auto end = std::min<size_t>(productStartIndex, formats.size());
+        shuffle->songs.reserve(end);
+        for (uint32_t i = 0; i < end; i++) {
+            if (collection >= 0 && (formats[i] >> 8) != collection) continue;
+            if (format != ANY && songStore.formatId(i) != format) continue;
+            if (composer != ANY && songStore.composerId(i) != composer)
+                continue;
+            shuffle->songs.push_back(i);
+        }
+    }
+    LOGD("Shuffling %d songs", shuffle->songs.size());
+
+    return [this, shuffle](SongInfo& song) {
+        auto& songs = shuffle->songs;
+        while (shuffle->pos < songs.size()) {
+            // One Fisher-Yates step per song drawn
+            std::uniform_int_distribution<size_t> pick(shuffle->pos,
+                                                       songs.size() - 1);
+            std::swap(songs[shuffle->pos], songs[pick(shuffle->rng)]);
+            try {
+                song = getSongInfo(songs[shuffle->pos++]);
+            } catch (not_found_exception&) {
+                continue;
+            }
+            if (!endsWith(song.path, ".plist")) return true;
+        }
+        return false;
+    };
+}
+
+MusicDatabase::SmartPlaylist::SmartPlaylist(const utils::path& f)
+    : name(f.filename().string())
+{
+    for (auto const& l : apone::File{ f }.lines()) {
+        auto pos = l.find('=');
+        if (l.empty() || l[0] == '#' || pos == std::string::npos) continue;
+        auto key = toLower(lrstrip(l.substr(0, pos), ' '));
+        rules[key] = lrstrip(l.substr(pos + 1), ' ');
+    }
+}
+
+// Ranges of format bytes for each format class
+static std::map<std::string, std::pair<int, int>> const formatClasses = {
+    { "console", { CONSOLE, COMPUTER } },
+    { "nintendo", { NINTENDO, SEGA } },
+    { "sega", { SEGA, SONY } },
+    { "sony", { SONY, COMPUTER } },
+    { "computer", { COMPUTER, PRODUCT } },
+    { "c64", { C64, SPECTRUM } },
+    { "spectrum", { SPECTRUM, ATARI } },
+    { "atari", { ATARI, MP3 } },
+    { "mp3", { MP3, YOUTUBE } },
+    { "youtube", { YOUTUBE, PC } },
+    { "pc", { PC, TRACKER } },
+    { "tracker", { TRACKER, AMIGA } },
+    { "amiga", { AMIGA, PRODUCT } },
+};
+
+MusicDatabase::SongSource MusicDatabase::smartSongs(std::string const& name)
+{
+    auto nothing = [](SongInfo&) { return false; };
+
+    std::lock_guard lock{ dbMutex };
+
+    // Filled by initFromLua() under the same lock
+    auto pl = std::find_if(smartLists.begin(), smartLists.end(),
+                           [&](auto const& sl) { return sl.name == name; });
+    if (pl == smartLists.end()) return nothing;
+
+    if (songStore.size() == 0) {
+        LOGI("Smart playlists require RESIDENT_SONGS");
+        return nothing;
+    }
+
+    int collection = -1;
+    auto coll = pl->rule("collection");
+    if (coll != "") {
+        auto it = collectionRows.find(toLower(coll));
+        if (it == collectionRows.end()) return nothing;
+        collection = it->second;
+    }
+
+    std::pair<int, int> formatClass{ 0, 0x100 };
+    auto cls = pl->rule("class");
+    if (cls != "") {
+        auto it = formatClasses.find(toLower(cls));
+        if (it == formatClasses.end()) return nothing;
+        formatClass = it->second;
+    }
+
+    // Empty means any
+    std::vector<bool> formatMatch;
+    std::vector<bool> composerMatch;
+    if (pl->rule("format") != "")
+        formatMatch = songStore.matchStrings(pl->rule("format"));
+    if (pl->rule("composer") != "")
+        composerMatch = songStore.matchStrings(pl->rule("composer"));
+
+    std::vector<bool> inProduct;
+    auto type = pl->rule("type");
+    if (type != "") {
+        inProduct.resize(songStore.size());
+        auto q = db.query<uint32_t>(
+            "SELECT ROWID FROM product WHERE type LIKE ?", "%" + type + "%");
+        while (q.step()) {
+            songStore.forProductSongs(q.get(),
+                                      [&](uint32_t i) { inProduct[i] = true; });
+        }
+    }
+
+    uint32_t playedAfter = 0;
+    auto days = pl->rule("notplayed");
+    if (days != "") playedAfter = time(nullptr) - atoi(days.c_str()) * 86400;
+
+    auto songs = std::make_shared<std::vector<uint32_t>>();
+    auto end = std::min<size_t>(songStore.size(), formats.size());
+    for (uint32_t i = 0; i < end; i++) {
+        int f = formats[i] & 0xff;
+        if (f < formatClass.first || f >= formatClass.second) continue;
+        if (collection >= 0 && (formats[i] >> 8) != collection) continue;
+        if (!formatMatch.empty() && !formatMatch[songStore.formatId(i)])
+            continue;
+        if (!composerMatch.empty() && !composerMatch[songStore.composerId(i)])
+            continue;
+        if (!inProduct.empty() && !inProduct[i]) continue;
+        if (playedAfter > 0 && i < lastPlayed.size() &&
+            lastPlayed[i] >= playedAfter)
+            continue;
+        songs->push_back(i);
+    }
+    LOGD("Smart playlist '%s' matched %d songs", name, songs->size());
+
+    if (toLower(pl->rule("order")) == "random") {
+        static std::mt19937 rng{ std::random_device{}() };
+        std::shuffle(songs->begin(), songs->end(), rng);
+    }
+
+    // Songs are only looked up as the play queue needs them
+    return [this, songs, pos = size_t{ 0 }](SongInfo& song) mutable {
+        while (pos < songs->size()) {
+            try {
+                song = getSongInfo((*songs)[pos++]);
+            } catch (not_found_exception&) {
+                continue;
+            }
+            if (!endsWith(song.path, ".plist")) return true;
+        }
+        return false;
+    };
+}
+
+void MusicDatabase::loadHistory()
+{
+    lastPlayed.assign(songStore.size(), 0);
+    playedSongs = 0;
+    historyLines = 0;
+    auto historyFile = Environment::getConfigDir() / "history";
+    if (!utils::exists(historyFile)) return;
+    for (auto const& l : apone::File{ historyFile }.lines()) {
+        auto parts = split(l, "\t");
+        if (parts.size() < 2) continue;
+        historyLines++;
+        auto path = split(parts[1], "::");
+        auto index = songStore.findPath(path.size() > 1 ? path[1] : path[0]);
+        if (index >= 0) lastPlayed[index] = std::stoul(parts[0]);
+    }
+    playedSongs = std::count_if(lastPlayed.begin(), lastPlayed.end(),
+                                [](uint32_t t) { return t != 0; });
+}
+
+// Analyzed files are keyed on their full path
+static std::string analysisKey(std::string const& path)
+{
+    return std::filesystem::absolute(path).lexically_normal().string();
+}
+
+void MusicDatabase::putAnalysis(std::string const& path, int tune,
+                                int tunes, int lengthMs)
+{
+    std::lock_guard lock{ dbMutex };
+    statement<>("INSERT OR REPLACE INTO analysis (path, tune, tunes, length) "
+                "VALUES (?, ?, ?, ?)")
+        .bind(analysisKey(path), tune, tunes, lengthMs)
+        .step();
+}
+
+bool MusicDatabase::getAnalysis(std::string const& path, int tune, int& tunes,
+                                int& lengthMs) const
+{
+    std::lock_guard lock{ dbMutex };
+    auto& q = statement<int, int>(
+        "SELECT tunes, length FROM analysis WHERE path = ? AND tune = ?");
+    q.bind(analysisKey(path), tune);
+    if (!q.step()) return false;
+    std::tie(tunes, lengthMs) = q.get_tuple();
+    return true;
+}
+
+void MusicDatabase::markPlayed(SongInfo const& song)
+{
+    std::unique_lock lock{ dbMutex };
+    if (songStore.size() == 0) return;
+    auto parts = split(song.path, "::");
+    auto index = songStore.findPath(parts.size() > 1 ? parts[1] : parts[0]);
+    if (index < 0 || index >= (int64_t)lastPlayed.size()) return;
+
+    uint32_t now = time(nullptr);
+    if (lastPlayed[index] == 0) playedSongs++;
+    lastPlayed[index] = now;
+
+    std::string text;
+    bool compact = historyLines > 2 * playedSongs + 1024;
+    if (compact) {
+        // Keep only the last play of each song
+        historyLines = 0;
+        for (uint32_t i = 0; i < lastPlayed.size(); i++) {
+            if (lastPlayed[i] == 0) continue;
+            auto s = songStore.get(i);
+            text += utils::format("%u\t%s::%s\n", lastPlayed[i],
+                                  collectionName(s.collection),
+                                  std::string(s.path));
+            historyLines++;
+        }
+    } else {
+        text = utils::format("%u\t%s\n", now, song.path);
+        historyLines++;
+    }
+
+    // Write without holding up lookups; `historyMutex` keeps the writes in
+    // the order the lines were made
+    std::lock_guard historyLock{ historyMutex };
+    lock.unlock();
+    auto historyFile = (Environment::getConfigDir() / "history").string();
+    std::ofstream f{ historyFile, compact ? std::ios::out | std::ios::trunc
+                                          : std::ios::app };
+    f << text;
+}
+
+MusicDatabase::Playlist::Playlist(const utils::path& f) : fileName(f.string())
+{
+    if (utils::exists(f)) {
+        std::vector<std::string> lines;
+        for (auto const& l : apone::File{ f }.lines()) {
+            if (!l.empty()) lines.push_back(l);
+        }
+        songs = replay(lines);
+        journalLines = lines.size();
+    }
+    for (auto const& s : songs)
+        members[key(s.path, s.starttune)]++;
+    name = f.filename().string();
+}
+
+// A removal matches the same song and tune, and also entries for the
+// whole song (no tune)
+static bool removes(SongInfo const& song, SongInfo const& toRemove)
+{
+    return song.path == toRemove.path &&
+           (song.starttune == -1 || song.starttune == toRemove.starttune);
+}
+
+std::vector<SongInfo>
+MusicDatabase::Playlist::replay(std::vector<std::string> const& lines)
+{
+    std::vector<SongInfo> songs;
+    for (auto const& l : lines) {
+        if (l.empty()) continue;
+        if (l[0] == '-') {
+            SongInfo toRemove(l.substr(1));
+            songs.erase(std::remove_if(songs.begin(), songs.end(),
+                                       [&](SongInfo const& song) {
+                                           return removes(song, toRemove);
+                                       }),
+                        songs.end());
+        } else
+            songs.emplace_back(l);
+    }
+    return songs;
+}
+
+void MusicDatabase::Playlist::add(SongInfo const& song)
+{
+    songs.push_back(song);
+    members[key(song.path, song.starttune)]++;
+    append(key(song.path, song.starttune));
+}
+
+void MusicDatabase::Playlist::remove(SongInfo const& toRemove)
+{
+    // Nothing to scan for if neither the tune nor the whole song is here
+    if (!contains(toRemove.path, toRemove.starttune) &&
+        !contains(toRemove.path, -1))
+        return;
+
+    songs.erase(std::remove_if(songs.begin(), songs.end(),
+                               [&](SongInfo const& song) {
+                                   if (!removes(song, toRemove)) return false;
+                                   auto k = key(song.path, song.starttune);
+                                   if (--members[k] == 0) members.erase(k);
+                                   return true;
+                               }),
+                songs.end());
+    append("-" + key(toRemove.path, toRemove.starttune));
+}
+
+void MusicDatabase::Playlist::append(std::string const& line)
+{
+    // Compact when most of the journal is dead
+    if (journalLines > 2 * songs.size() + 64) {
+        save();
+        return;
+    }
+    std::ofstream f{ fileName, std::ios::app };
+    f << line << "\n";
+    journalLines++;
+}
+
+void MusicDatabase::Playlist::save()
+{
+    apone::File f{ fileName, apone::File::Write };
+    LOGD("Writing to %s", fileName);
+    for (auto const& s : songs)
+        f.writeln(key(s.path, s.starttune));
+    journalLines = songs.size();
+}
+
 void MusicDatabase::addToPlaylist(std::string const& plist,
                                   SongInfo const& song)
 {
     for (auto& pl : playLists) {
         if (pl.name == plist) {
-            pl.songs.push_back(song);
-            pl.save();
+            pl.add(song);
             break;
         }
     }
@@ -1319,16 +1922,7 @@ void MusicDatabase::removeFromPlaylist(std::string const& plist,
 {
     for (auto& pl : playLists) {
         if (pl.name == plist) {
-            pl.songs.erase(std::remove_if(pl.songs.begin(), pl.songs.end(),
-                                          [&](SongInfo const& song) -> bool {
-                                              return song.path ==
-                                                         toRemove.path &&
-                                                     (song.starttune == -1 ||
-                                                      song.starttune ==
-                                                          toRemove.starttune);
-                                          }),
-                           pl.songs.end());
-            pl.save();
+            pl.remove(toRemove);
             break;
         }
     }
@@ -1342,4 +1936,13 @@ std::vector<SongInfo>& MusicDatabase::getPlaylist(std::string const& plist)
     }
     return empty;
 }
+
+bool MusicDatabase::playlistContains(std::string const& plist,
+                                     std::string const& path, int tune) const
+{
+    for (auto const& pl : playLists) {
+        if (pl.name == plist) return pl.contains(path, tune);
+    }
+    return false;
+}
 } // namespace chipmachine
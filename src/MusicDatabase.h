@@ -3,6 +3,7 @@
 
 #include "SearchIndex.h"
 #include "SongInfo.h"
+#include "SongStore.h"
 
 #include <coreutils/environment.h>
 #include <coreutils/file.h>
@@ -12,6 +13,7 @@
 #include <coreutils/thread.h>
 #include <future>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <unordered_map>
@@ -147,6 +149,8 @@ public:
     std::string getTitle(int index) const
     {
         std::lock_guard lock{ dbMutex };
+        if (index >= SMARTLIST_INDEX)
+            return smartLists[index - SMARTLIST_INDEX].name;
         if (index >= PLAYLIST_INDEX)
             return playLists[index - PLAYLIST_INDEX].name;
         return titleIndex.getString(index);
@@ -168,6 +172,13 @@ public:
     int getSongs(std::vector<SongInfo>& target, SongInfo const& match,
                  int limit, bool random);
 
+    // Produces the next song in `song`, returns false when exhausted
+    using SongSource = std::function<bool(SongInfo& song)>;
+
+    // Random order of all songs matching format, composer and collection
+    // of `match`. The permutation is generated lazily as songs are drawn.
+    SongSource randomSongs(SongInfo const& match);
+
     bool busy()
     {
         std::lock_guard lock{ chkMutex };
@@ -188,48 +199,100 @@ public:
     }
 
     SongInfo& lookup(SongInfo& song);
+    // Lookup many songs in one go, holding the lock once
+    void lookup(std::vector<SongInfo>& songs);
 
     std::vector<SongInfo> getProductSongs(uint32_t id);
 
 private:
+    SongInfo& resolve(SongInfo& song);
+    SongInfo songInfo(int index) const;
+    SongInfo storedSong(uint32_t index, bool withMetadata = true) const;
+    int getStoredSongs(std::vector<SongInfo>& target, SongInfo const& match,
+                       int limit, bool random);
     std::string getProductScreenshots(uint32_t id);
-    std::string getScreenshotURL(std::string const& collection);
+    std::string getScreenshotURL(std::string const& collection) const;
+    std::string resolveScreenshots(std::string const& shot,
+                                   std::string const& collection) const;
 
 public:
     std::string getSongScreenshots(SongInfo& s);
 
+    // Playlists are stored as a journal; added songs are appended as plain
+    // lines and removals as lines starting with '-'. The file is rewritten
+    // (compacted) once the journal grows too long.
     struct Playlist
     {
         std::string name;
         std::string fileName;
         std::vector<SongInfo> songs;
 
-        explicit Playlist(const utils::path& f) : fileName(f.string())
+        explicit Playlist(const utils::path& f);
+
+        // Apply journal lines in order to get the resulting songs
+        static std::vector<SongInfo>
+        replay(std::vector<std::string> const& lines);
+
+        void add(SongInfo const& song);
+        void remove(SongInfo const& song);
+
+        [[nodiscard]] bool contains(std::string const& path, int tune) const
         {
-            if (utils::exists(f)) {
-                for (auto const& l : apone::File{ f }.lines()) {
-                    if (!l.empty()) songs.emplace_back(l);
-                }
-            }
-            name = f.filename().string();
+            return members.count(key(path, tune)) > 0;
         }
 
-        void save()
+        // Rewrite the file with only the current songs
+        void save();
+
+    private:
+        static std::string key(std::string const& path, int tune)
         {
-            apone::File f{ fileName, apone::File::Write };
-            LOGD("Writing to %s", fileName);
-            for (auto const& s : songs) {
-                if (s.starttune >= 0)
-                    f.writeln(utils::format("%s;%d", s.path, s.starttune));
-                else
-                    f.writeln(s.path);
-            }
+            return tune >= 0 ? utils::format("%s;%d", path, tune) : path;
         }
+        void append(std::string const& line);
+
+        // Number of times each path;tune occurs in `songs`
+        std::unordered_map<std::string, int> members;
+        size_t journalLines = 0;
     };
 
+    // Rule based playlist, evaluated in bulk against the resident song
+    // columns when played. One `key = value` rule per line, all rules must
+    // match. Keys are collection, class (format class like amiga or c64),
+    // format, composer, type (product type), notplayed (days) and
+    // order (random).
+    struct SmartPlaylist
+    {
+        std::string name;
+        std::map<std::string, std::string> rules;
+
+        explicit SmartPlaylist(const utils::path& f);
+
+        [[nodiscard]] std::string rule(std::string const& key) const
+        {
+            auto it = rules.find(key);
+            return it != rules.end() ? it->second : "";
+        }
+    };
+
+    SongSource smartSongs(std::string const& name);
+
+    // Remember that a song was played, for smart playlists
+    void markPlayed(SongInfo const& song);
+
+    // Song lengths found by rendering local files offline (`chipmachine
+    // analyze`). Length is where the sound ends, 0 for looping songs.
+    void putAnalysis(std::string const& path, int tune, int tunes,
+                     int lengthMs);
+    // Returns false if the song has not been analyzed
+    bool getAnalysis(std::string const& path, int tune, int& tunes,
+                     int& lengthMs) const;
+
     void addToPlaylist(std::string const& plist, SongInfo const& song);
     void removeFromPlaylist(std::string const& plist, SongInfo const& toRemove);
     std::vector<SongInfo>& getPlaylist(std::string const& plist);
+    bool playlistContains(std::string const& plist, std::string const& path,
+                          int tune) const;
 
     void setFilter(std::string const& filter, int type = 0);
 
@@ -279,8 +342,33 @@ private:
     void readIndex(apone::File&& f);
 
     void createTables();
+    void loadCollections();
+    void loadSongStore();
+
+    // Collection id ("hvsc", "modland" etc) from collection ROWID
+    std::string const& collectionName(int rowid) const
+    {
+        static std::string const empty;
+        if (rowid < 0 || rowid >= (int)collections.size()) return empty;
+        return collections[rowid].name;
+    }
+
+    // Prepared statements are compiled once and kept for the lifetime of
+    // the connection. `sql` must be a string literal; its address is the key.
+    template <typename... T>
+    sqlite3db::Query<T...>& statement(char const* sql) const
+    {
+        auto& s = statements[sql];
+        if (!s) {
+            s = std::make_shared<sqlite3db::Query<T...>>(db.query<T...>(sql));
+        }
+        return *std::static_pointer_cast<sqlite3db::Query<T...>>(s);
+    }
+
+    void loadHistory();
 
     static constexpr int PLAYLIST_INDEX = 0x10000000;
+    static constexpr int SMARTLIST_INDEX = 0x18000000;
 
     RemoteLoader& remoteLoader;
 
@@ -297,6 +385,16 @@ private:
     sqlite3db::Database db;
     bool reindexNeeded;
 
+    mutable std::unordered_map<char const*, std::shared_ptr<void>> statements;
+
+    // The collection table is small; keep it resident. Indexed by ROWID.
+    std::vector<Collection> collections;
+    std::unordered_map<std::string, int> collectionRows;
+
+    // Optional resident copy of the song table (RESIDENT_SONGS in db.lua)
+    bool residentSongs = true;
+    SongStore songStore;
+
     uint16_t dbVersion{};
     uint16_t indexVersion{};
 
@@ -306,6 +404,15 @@ private:
     std::atomic<bool> indexing{};
 
     std::vector<Playlist> playLists;
+    std::vector<SmartPlaylist> smartLists;
+
+    // Last time (seconds since epoch) each song was played, 0 if never
+    std::vector<uint32_t> lastPlayed;
+    // Non zero entries in `lastPlayed`
+    size_t playedSongs = 0;
+    size_t historyLines = 0;
+    // Taken while writing the history file, after `dbMutex` is released
+    std::mutex historyMutex;
     std::unordered_map<uint64_t, uint32_t> pathMap;
     uint32_t productStartIndex{};
     std::vector<uint8_t> dontIndex;
@@ -1,100 +1,505 @@
 #include "MusicPlayer.h"
 #include "GZPlugin.h"
+#include "MemFile.h"
+#include "PcmKernels.h"
+#include "PluginRegistry.h"
 #include "modutils.h"
 
 #include <archive/archive.h>
 #include <audioplayer/audioplayer.h>
+#include <coreutils/environment.h>
 #include <coreutils/format.h>
 #include <coreutils/utils.h>
 #include <musicplayer/plugins/plugins.h>
 #include <psf/PSFFile.h>
 
 #include <algorithm>
+#include <chrono>
+#include <cstdlib>
 #include <set>
 
 namespace chipmachine {
 
 MusicPlayer::MusicPlayer(AudioPlayer& ap)
-    : fifo(32786 * 4),
+    : hz(outputHz), fifo(32768 * 4),
+      temp_buf(BufferTuner::ChunkFrames * 2),
+      next_buf(BufferTuner::ChunkFrames * 2),
+      song_cache((Environment::getCacheDir() / "_pcm").string()),
       stream_fifo(std::make_shared<utils::Fifo<uint8_t>>(32768 * 8)),
       audio_player(ap)
 {
+    resampler.setup(PluginHz, hz, outputQuality);
     audio_player.set_volume(80);
     volume = 0.8;
 
-    musix::ChipPlugin::addPlugin(
-        std::make_shared<GZPlugin>(musix::ChipPlugin::getPlugins()), true);
+    musix::ChipPlugin::addPlugin(std::make_shared<GZPlugin>(), true);
 
+    if (realtimeOptions.enabled) {
+        // Room for a full ring of resampled output, so it never grows
+        out_buf.reserve(fifo.size() * 2);
+        memory_locked =
+            Realtime::lockMemory(fifo.data(), fifo.size() * 2) &&
+            Realtime::lockMemory(temp_buf.data(), temp_buf.size() * 2) &&
+            Realtime::lockMemory(next_buf.data(), next_buf.size() * 2) &&
+            Realtime::lockMemory(out_buf.data(), out_buf.capacity() * 2);
+    }
+
+    // Runs on the audio thread; must never block
     audio_player.play([this](int16_t* ptr, int size) mutable {
+        if (!audio_rt_applied) {
+            // The audio thread belongs to the backend, so this is the first
+            // chance to change it
+            audio_rt_applied = true;
+            if (realtimeOptions.enabled) {
+                audio_rt = Realtime::applyToThread(realtimeOptions, 1);
+                audio_rt_done = true;
+            }
+        }
         if (dont_play) {
             memset(ptr, 0, size * 2);
             return;
         }
 
-        if (fifo.filled() >= size) {
-            fifo.get(ptr, size);
-            play_pos += size / 2;
+        int got = fifo.get(ptr, size);
+        if (got < size) {
+            memset(ptr + got, 0, (size - got) * 2);
+            if (active && !play_ended && play_pos > 0) fifo.underrun();
+        }
+        if (got > 0) {
+            play_pos += got / 2;
             if (audio_callback) audio_callback(ptr, size);
-        } else
-            memset(ptr, 0, size * 2);
+        }
     });
+
+    decodeThread = std::thread([this] { decodeLoop(); });
 }
 
-// Make sure the fifo is filled
-void MusicPlayer::update()
+// Samples quieter than this count as silence
+static constexpr int SilenceLevel = 16;
+
+// Number of trailing stereo frames in `ptr` that are silent
+static int trailingSilence(int16_t const* ptr, int count)
+{
+    return pcmTrailingQuiet(ptr, count, SilenceLevel) / 2;
+}
+
+// Mix `next` into `ptr` with a linear ramp; `pos` and `len` in frames
+static void crossfade(int16_t* ptr, int16_t const* next, int count,
+                      int64_t pos, int64_t len)
+{
+    for (int i = 0; i < count; i += 2) {
+        float g = (float)(pos + i / 2) / (float)len;
+        ptr[i] = (int16_t)(ptr[i] * (1.0F - g) + next[i] * g);
+        ptr[i + 1] = (int16_t)(ptr[i + 1] * (1.0F - g) + next[i + 1] * g);
+    }
+}
+
+void MusicPlayer::decodeLoop()
 {
-    static std::vector<int16_t> temp_buf(fifo.size());
+    bool reported = !realtimeOptions.enabled;
+    if (!reported) decode_rt = Realtime::applyToThread(realtimeOptions, 0);
+    while (!quitDecoder) {
+        if (!reported && audio_rt_done) {
+            reportRealtime();
+            reported = true;
+        }
+        update();
+        // Sleep until the ring drains to the refill mark, but no longer than
+        // 20ms so new songs and seeks are picked up quickly
+        int above = (int)fifo.filled() - fill_target;
+        int ms = std::clamp(above / 88, 2, 20);
+        std::unique_lock lock{ wakeMutex };
+        wakeCond.wait_for(lock, std::chrono::milliseconds(ms));
+    }
+}
 
-    if (!paused && player) {
+// Startup report of what --realtime achieved, once the audio thread has
+// tried
+void MusicPlayer::reportRealtime()
+{
+    utils::print_fmt("Realtime: audio %s, decoder %s, buffers %s\n",
+                     audio_rt.describe(), decode_rt.describe(),
+                     memory_locked ? "locked" : "not locked");
+}
 
-        sub_title = player->getMeta("sub_title");
-        length = player->getMetaInt("length");
-        message = player->getMeta("message");
-        silent_frames = check_silence ? fifo.getSilence() : 0;
+void MusicPlayer::wakeDecoder()
+{
+    wakeCond.notify_one();
+}
+
+// Make sure the fifo is filled. Plugins decode one chunk at a time without
+// `playerMutex`, so other threads never wait for the emulator; a change
+// made meanwhile shows in `generation`, and the chunk is not played.
+void MusicPlayer::update()
+{
+    std::unique_lock lock{ playerMutex };
+
+    auto underruns = fifo.getUnderruns();
+    if (underruns != reported_underruns) {
+        tuner.underrun();
+        LOGD("Audio underrun (%d total), %s now buffers %dms", underruns,
+             plugin_name, tuner.targetMs());
+        reported_underruns = underruns;
+    }
+    // Keep room for one more chunk at the top of the ring
+    fill_target = (int)std::min<int64_t>(
+        (int64_t)tuner.targetMs() * hz * 2 / 1000, fifo.size() - 8192);
+
+    // Where the song ends, from the plugin or else from analysis
+    int64_t end_frame = 0;
+    int64_t known_end = 0;
+    auto findEnd = [&] {
+        length = plugin_length;
+        end_frame = (int64_t)length * PluginHz;
+        known_end = 0;
+        if (length <= 0 && known_length > 0) {
+            length = (known_length + 999) / 1000;
+            end_frame = (int64_t)known_length * PluginHz / 1000;
+            // Decode a little past the sound so the ring drains it
+            known_end = end_frame + PluginHz;
+        }
+        song_end = end_frame;
+    };
 
-        while (true) {
+    while (!paused && player) {
 
-            int space_left = fifo.left();
+        // May have changed while the lock was released
+        if (meta_changed) readMeta();
+        findEnd();
 
-            if (space_left < 4096) break;
+        int space_left = fifo.left();
 
-            int samples_generated =
-                player->getSamples(&temp_buf[0], space_left - 1024);
+        if (space_left < 4096 || (int)fifo.filled() >= fill_target) break;
 
-            if (samples_generated <= 0) {
-                play_ended = samples_generated < 0;
+        // Samples at PluginHz that fit after resampling, in chunks
+        int64_t count = (int64_t)(space_left - 1024) * PluginHz / hz;
+        count = std::min<int64_t>(count, temp_buf.size()) & ~1;
+
+        // With a prepared next song, stop exactly where it should start
+        if (next_player && xfade_start < 0 && end_frame > 0) {
+            int64_t start = end_frame - crossfade_frames;
+            if (written_frames >= start)
+                xfade_start = written_frames;
+            else
+                count = std::min(count, (start - written_frames) * 2);
+        }
+        // Nothing but silence left to decode
+        if (!next_player && known_end > 0) {
+            if (written_frames >= known_end) {
+                play_ended = true;
                 break;
             }
-            if (fadeout_pos != 0 && fadeout_pos >= play_pos) {
-                fifo.setVolume((fadeout_pos - play_pos) / (float)fade_length);
+            count = std::min(count, (known_end - written_frames) * 2);
+        }
+        if (xfade_start >= 0) {
+            auto left = xfade_start + crossfade_frames - written_frames;
+            if (left <= 0) {
+                startNext();
+                continue;
             }
+            count = std::min(count, left * 2);
+        }
 
-            fifo.put(&temp_buf[0], samples_generated);
-            if (fifo.filled() >= fifo.size() / 2) {
-                break;
+        auto gen = generation.load();
+        int64_t frame = written_frames;
+        bool mixing = xfade_start >= 0;
+        // Set if the plugin has to decode this chunk
+        std::shared_ptr<musix::ChipPlayer> chip;
+        bool from_plugin = false;
+        int samples_generated = 0;
+        if (cached_song) {
+            samples_generated =
+                cached_song->read(written_frames, &temp_buf[0], count);
+            // Ends like the plugin would
+            if (samples_generated == 0) samples_generated = -1;
+        } else if (written_frames < seek_cache.end()) {
+            // Seeked back into audio that was already decoded
+            samples_generated =
+                seek_cache.read(written_frames, &temp_buf[0], count);
+        } else {
+            from_plugin = true;
+            samples_generated = head.peek(&temp_buf[0], count);
+            if (samples_generated == 0) chip = player;
+        }
+        // The next song comes from what prepareNext() decoded, then from
+        // its plugin
+        int next_got = mixing ? next_head.peek(&next_buf[0], count) : 0;
+        auto next_chip = mixing ? next_player : nullptr;
+        int next_decoded = 0;
+
+        if (chip || (next_chip && samples_generated > next_got)) {
+            double seconds = 0;
+            bool decoded = false;
+            lock.unlock();
+            {
+                std::lock_guard decode_lock{ decodeMutex };
+                if (generation == gen) {
+                    decoded = true;
+                    if (chip) {
+                        auto start = std::chrono::steady_clock::now();
+                        samples_generated =
+                            chip->getSamples(&temp_buf[0], count);
+                        std::chrono::duration<double> t =
+                            std::chrono::steady_clock::now() - start;
+                        seconds = t.count();
+                    }
+                    if (next_chip && samples_generated > next_got) {
+                        next_decoded = std::max(
+                            next_chip->getSamples(&next_buf[next_got],
+                                                  samples_generated - next_got),
+                            0);
+                    }
+                }
             }
+            lock.lock();
+            if (!decoded) continue;
+            if (chip) tuner.decoded(samples_generated / 2, PluginHz, seconds);
         }
+        bool stale = generation != gen;
+
+        // Plugin output is stored even when stale, as long as the plugin
+        // is the same, so it stays in step with the seek cache
+        if (from_plugin && samples_generated > 0 &&
+            (!stale || (chip && chip == player && seek_cache.end() == frame))) {
+            if (!chip) head.skip(samples_generated);
+            seek_cache.append(frame, &temp_buf[0], samples_generated);
+            if (recording)
+                recording->append(frame, &temp_buf[0], samples_generated);
+        }
+
+        if (stale) {
+            // The next song's plugin has moved on all the same
+            if (next_decoded > 0 && next_chip == next_player) {
+                next_head.skip(next_got);
+                next_written += (next_got + next_decoded) / 2;
+            }
+            continue;
+        }
+
+        if (samples_generated <= 0) {
+            if (samples_generated < 0) finishRecording(true);
+            if (samples_generated < 0 && next_player) {
+                if (xfade_start < 0) xfade_start = written_frames;
+                startNext();
+                continue;
+            }
+            play_ended = samples_generated < 0;
+            break;
+        }
+
+        if (mixing) {
+            int from_head = std::min(next_got, samples_generated);
+            next_head.skip(from_head);
+            int got = from_head + next_decoded;
+            memset(&next_buf[got], 0, (samples_generated - got) * 2);
+            crossfade(&temp_buf[0], &next_buf[0], samples_generated,
+                      written_frames - xfade_start, crossfade_frames);
+            next_written += got / 2;
+        }
+        written_frames += samples_generated / 2;
+        // A crossfade asked for while decoding starts with the next chunk
+        if (!mixing && xfade_start >= 0 && xfade_start < written_frames)
+            xfade_start = written_frames;
+        // Ramp from the previous block's volume so the fade has no steps
+        float fade_from = fade_volume;
+        if (fadeout_pos != 0 && fadeout_pos >= play_pos) {
+            fade_volume = (fadeout_pos - play_pos) / (float)fade_length;
+        }
+        if (fade_from < 1.0F || fade_volume < 1.0F) {
+            pcmGainRamp(&temp_buf[0], samples_generated, fade_from,
+                        fade_volume);
+        }
+
+        if (check_silence) {
+            int silent = trailingSilence(&temp_buf[0], samples_generated);
+            if (silent * 2 == samples_generated)
+                silent_frames += silent;
+            else
+                silent_frames = silent;
+        } else
+            silent_frames = 0;
+
+        if (resampler.active()) {
+            out_buf.clear();
+            resampler.process(&temp_buf[0], samples_generated, out_buf);
+            fifo.put(out_buf.data(), out_buf.size());
+        } else
+            fifo.put(&temp_buf[0], samples_generated);
+    }
+}
+
+// Let the prepared song take over. Called with `playerMutex` held.
+void MusicPlayer::startNext()
+{
+    LOGD("Handing over to next song at frame %d", (int)xfade_start);
+    player = next_player;
+    next_player = nullptr;
+    // Swapped rather than moved, so no memory is freed here
+    std::swap(head, next_head);
+    next_head.clear();
+    check_silence = next_check_silence;
+    written_frames = next_written;
+    known_length = next_known_length;
+    seek_cache.reset(written_frames);
+    // Position goes negative while the end of the old song is still queued;
+    // subtract before counting the transition so readers never see a new
+    // transition with an old position
+    play_pos -= (int)(xfade_start * hz / PluginHz);
+    xfade_start = -1;
+    fadeout_pos = 0;
+    fade_volume = 1.0F;
+    silent_frames = 0;
+    play_ended = false;
+    updatePlayingInfo();
+    currentTune = next_tune;
+    song_file = next_file;
+    plugin_name = next_plugin_name;
+    tuner.setPlugin(plugin_name);
+    // Opened by prepareNext(), as the decoder must not wait for the disk.
+    // Swapped, so the old song is closed by whoever next replaces
+    // `next_cached`, and an unused recording is dropped the same way.
+    finishRecording(false);
+    song_end = 0;
+    std::swap(cached_song, next_cached);
+    // A recording must start at the beginning, not after a crossfade
+    if (written_frames == 0) std::swap(recording, next_recording);
+    transitions++;
+}
+
+bool MusicPlayer::prepareNext(const std::string& fileName, int tune)
+{
+    bool silence = true;
+    std::string pluginName;
+    auto newPlayer = fromFile(fileName, silence, pluginName);
+    if (!newPlayer) return false;
+    if (tune >= 0)
+        newPlayer->seekTo(tune, -1);
+    else
+        tune = std::max(newPlayer->getMetaInt("startSong"), 0);
+
+    // Decode the start here, outside the lock, instead of on the decoder
+    // at the moment of the switch
+    Decoded decoded;
+    decoded.samples.resize(PrepareChunks * BufferTuner::ChunkFrames * 2);
+    int size = 0;
+    while (size < (int)decoded.samples.size()) {
+        int n = newPlayer->getSamples(&decoded.samples[size],
+                                      BufferTuner::ChunkFrames * 2);
+        if (n <= 0) break;
+        size += n;
     }
+    decoded.samples.resize(size);
+
+    std::unique_ptr<PcmCache::Song> cached;
+    std::unique_ptr<PcmCache::Recording> rec;
+    openCache(fileName, tune, cached, rec);
+
+    std::lock_guard lock{ playerMutex };
+    generation++;
+    std::swap(next_head, decoded);
+    std::swap(next_cached, cached);
+    std::swap(next_recording, rec);
+    next_player = newPlayer;
+    next_file = fileName;
+    next_plugin_name = pluginName;
+    next_check_silence = silence;
+    next_tune = tune;
+    next_written = 0;
+    next_known_length = 0;
+    return true;
+}
+
+void MusicPlayer::setKnownLength(int ms, bool next)
+{
+    std::lock_guard lock{ playerMutex };
+    (next ? next_known_length : known_length) = ms;
+}
+
+int MusicPlayer::getNextTune() const
+{
+    std::lock_guard lock{ playerMutex };
+    return next_tune;
+}
+
+void MusicPlayer::dropNext()
+{
+    std::lock_guard lock{ playerMutex };
+    generation++;
+    next_player = nullptr;
+    next_head.clear();
+    next_cached = nullptr;
+    next_recording = nullptr;
+    xfade_start = -1;
+}
+
+bool MusicPlayer::hasNext() const
+{
+    std::lock_guard lock{ playerMutex };
+    return next_player != nullptr;
+}
+
+bool MusicPlayer::playNext()
+{
+    std::scoped_lock lock{ decodeMutex, playerMutex };
+    if (!next_player) return false;
+    generation++;
+    fifo.clear();
+    xfade_start = 0;
+    startNext();
+    resampler.reset();
+    play_pos = (int)(written_frames * hz / PluginHz);
+    pause(false);
+    wakeDecoder();
+    return true;
+}
+
+int MusicPlayer::getTransitions() const
+{
+    // Not audible until the old song has drained from the ring
+    return play_pos >= 0 ? transitions.load() : transitions - 1;
 }
 
 MusicPlayer::~MusicPlayer()
 {
+    quitDecoder = true;
+    wakeDecoder();
     stream_fifo->quit();
+    decodeThread.join();
 }
 
 void MusicPlayer::seek(int song, int seconds)
 {
+    std::scoped_lock lock{ decodeMutex, playerMutex };
     if (!player) return;
-    if (player->seekTo(song, seconds)) {
-        if (seconds < 0)
-            play_pos = 0;
-        else
-            play_pos = seconds * 44100;
-        fifo.clear();
+    bool sameTune = song < 0 || song == currentTune;
+    int64_t target = (int64_t)std::max(seconds, 0) * PluginHz;
+    // Within what has been decoded, the decoder reads from the cache until
+    // it catches up with the plugin
+    bool cached = sameTune && (cached_song ? target < cached_song->frames()
+                                           : target >= seek_cache.begin() &&
+                                                 target <= seek_cache.end());
+    if (cached) {
+        LOGD("Seeking to %ds from cache", std::max(seconds, 0));
+    } else if (player->seekTo(song, seconds)) {
+        seek_cache.reset(target);
+        head.clear();
         // length = player->getMetaInt("length");
         updatePlayingInfo();
-        currentTune = song;
-    }
+        if (!sameTune) known_length = 0;
+        if (song >= 0) currentTune = song;
+        // The plugin is where the cached song would have been
+        cached_song = nullptr;
+    } else
+        return;
+
+    generation++;
+    play_pos = (int)(target * hz / PluginHz);
+    written_frames = target;
+    if (!sameTune) openCached(currentTune);
+    xfade_start = -1;
+    fifo.clear();
+    resampler.reset();
+    wakeDecoder();
 }
 
 int MusicPlayer::getSilence() const
@@ -105,7 +510,13 @@ int MusicPlayer::getSilence() const
 // fadeOutPos music
 void MusicPlayer::fadeOut(float secs)
 {
-    fade_length = secs * 44100;
+    std::lock_guard lock{ playerMutex };
+    if (next_player) {
+        // Crossfade to the prepared song instead
+        if (xfade_start < 0) xfade_start = written_frames;
+        return;
+    }
+    fade_length = secs * hz;
     fadeout_pos = play_pos + fade_length;
 }
 
@@ -117,29 +528,35 @@ void MusicPlayer::putStream(const uint8_t* ptr, int size)
 
 void MusicPlayer::setParameter(const std::string& what, int v)
 {
+    std::scoped_lock lock{ decodeMutex, playerMutex };
     if (player) player->setParameter(what, v);
 }
 
 bool MusicPlayer::streamFile(const std::string& fileName)
 {
+    std::scoped_lock lock{ decodeMutex, playerMutex };
+    generation++;
     dont_play = true;
+    active = false;
     silent_frames = 0;
 
     playing_info = SongInfo();
-    std::string name = fileName;
     player = nullptr;
 
-    utils::makeLower(name);
     check_silence = true;
-    for (auto& plugin : musix::ChipPlugin::getPlugins()) {
-        if (plugin->canHandle(name)) {
-            LOGD("Playing with %s\n", plugin->name());
-            auto newPlayer = std::shared_ptr<musix::ChipPlayer>(
-                plugin->fromStream(stream_fifo));
-            if (newPlayer) player = newPlayer;
-            check_silence = plugin->checkSilence();
-            break;
+    auto plugins = PluginRegistry::candidates(fileName, false);
+    if (!plugins.empty()) {
+        auto const& plugin = plugins[0];
+        LOGD("Playing with %s\n", plugin->name());
+        auto newPlayer = std::shared_ptr<musix::ChipPlayer>(
+            plugin->fromStream(stream_fifo));
+        if (newPlayer) {
+            watchMeta(*newPlayer);
+            player = newPlayer;
+            plugin_name = plugin->name();
+            tuner.setPlugin(plugin_name);
         }
+        check_silence = plugin->checkSilence();
     }
 
     dont_play = false;
@@ -149,13 +566,26 @@ bool MusicPlayer::streamFile(const std::string& fileName)
 
         clearStreamFifo();
         fifo.clear();
+        resampler.reset();
+        next_player = nullptr;
+        head.clear();
+        next_head.clear();
+        next_cached = nullptr;
+        next_recording = nullptr;
+        xfade_start = -1;
+        written_frames = 0;
+        seek_cache.reset();
+        song_file.clear();
+        openCached(0);
+        known_length = 0;
+        fade_volume = 1.0F;
+        active = true;
         fadeout_pos = 0;
         pause(false);
         play_pos = 0;
-        message = "";
-        length = 0;
-        sub_title = "";
+        readMeta();
         currentTune = playing_info.starttune;
+        wakeDecoder();
         return true;
     }
     return false;
@@ -165,44 +595,127 @@ bool MusicPlayer::playFile(const std::string& fileName)
 {
 
     dont_play = true;
+    active = false;
     silent_frames = 0;
-    playing_info = SongInfo();
     std::string name = fileName;
+    {
+        // Wait for a chunk being decoded, so the old player is idle while
+        // the new one loads
+        std::scoped_lock lock{ decodeMutex, playerMutex };
+        generation++;
+        playing_info = SongInfo();
+        player = nullptr;
+    }
 
     if (utils::endsWith(name, ".rar")) {
+        // Unpacked to memory, and kept until the next song is played
+        auto dir = std::make_shared<MemFile>();
         try {
-            auto* a = utils::Archive::open(name, "_files");
+            std::unique_ptr<utils::Archive> a{ utils::Archive::open(
+                name, dir->dir().string()) };
             for (const auto& s : *a) {
                 a->extract(s);
-                name = "_files/" + s;
+                name = (dir->dir() / s).string();
                 LOGD("Extracted %s", name);
                 break;
             }
         } catch (utils::archive_exception& ae) {
-            player = nullptr;
             return false;
         }
+        extracted = dir;
     }
 
-    player = nullptr;
-    player = fromFile(name);
-
+    // Load outside the lock; the decoder has nothing to do meanwhile
+    bool silence = true;
+    std::string pluginName;
+    auto newPlayer = fromFile(name, silence, pluginName);
+
+    std::lock_guard lock{ playerMutex };
+    generation++;
+    player = newPlayer;
+    plugin_name = pluginName;
+    tuner.setPlugin(plugin_name);
+    check_silence = silence;
+    resampler.reset();
+    next_player = nullptr;
+    head.clear();
+    next_head.clear();
+    next_cached = nullptr;
+    next_recording = nullptr;
+    xfade_start = -1;
+    written_frames = 0;
+    seek_cache.reset();
     dont_play = false;
     play_ended = false;
 
     if (player) {
 
         fifo.clear();
+        fade_volume = 1.0F;
+        active = true;
         fadeout_pos = 0;
         pause(false);
         play_pos = 0;
         updatePlayingInfo();
         currentTune = playing_info.starttune;
+        song_file = fileName;
+        openCached(currentTune);
+        wakeDecoder();
         return true;
     }
     return false;
 }
 
+// Called with `playerMutex` held. Plays the subsong from the song cache if
+// it is there, otherwise records it.
+void MusicPlayer::openCached(int tune)
+{
+    finishRecording(false);
+    song_end = 0;
+    openCache(song_file, tune, cached_song, recording);
+    // A recording must start at the beginning
+    if (written_frames != 0) recording = nullptr;
+}
+
+// Find the subsong in the song cache, or else get a recording for it. This
+// reads the disk, so it is not for the decoder.
+void MusicPlayer::openCache(std::string const& file, int tune,
+                            std::unique_ptr<PcmCache::Song>& cached,
+                            std::unique_ptr<PcmCache::Recording>& rec)
+{
+    cached = nullptr;
+    rec = nullptr;
+    if (file.empty() || !song_cache.enabled()) return;
+    static const std::set<std::string> decoded = { "mp3", "ogg",  "wav",
+                                                   "flac", "m4a", "opus" };
+    auto ext = utils::path_extension(file);
+    utils::makeLower(ext);
+    if (decoded.count(ext) > 0) return;
+
+    cached = song_cache.open(file, tune);
+    if (cached) {
+        LOGD("Playing %s (%d) from song cache", file, tune);
+        return;
+    }
+    rec = song_cache.record(file, tune);
+}
+
+// Called with `playerMutex` held. A recording is kept if the song ended or
+// got past its length, as it will not play longer than that.
+void MusicPlayer::finishRecording(bool ended)
+{
+    if (recording &&
+        (ended || (song_end > 0 && recording->frames() >= song_end)))
+        recording->commit();
+    recording = nullptr;
+}
+
+void MusicPlayer::setSongCache(int64_t bytes)
+{
+    song_cache.setBudget(bytes);
+}
+
+// Called with `playerMutex` held
 void MusicPlayer::updatePlayingInfo()
 {
     SongInfo info;
@@ -221,10 +734,32 @@ void MusicPlayer::updatePlayingInfo()
     info.starttune = player->getMetaInt("startSong");
     if (info.starttune == -1) info.starttune = 0;
 
-    length = player->getMetaInt("length");
+    playing_info = info;
+    readMeta();
+}
+
+// Copy the metadata that may change while playing. Called with
+// `playerMutex` held.
+void MusicPlayer::readMeta()
+{
+    meta_changed = false;
+    plugin_length = player->getMetaInt("length");
+    length = plugin_length;
     message = player->getMeta("message");
     sub_title = player->getMeta("sub_title");
-    playing_info = info;
+    bitrate = player->getMetaInt("bitrate");
+    meta_version++;
+}
+
+// Stream titles, bitrates and lengths found while decoding are reported by
+// the plugin, so update() only reads metadata after a change. Any player
+// may report; re-reading for a change in the prepared song is harmless.
+void MusicPlayer::watchMeta(musix::ChipPlayer& chipPlayer)
+{
+    chipPlayer.onMeta([this](std::vector<std::string> const& /*changed*/,
+                             musix::ChipPlayer* /*player*/) {
+        meta_changed = true;
+    });
 }
 
 void MusicPlayer::pause(bool do_pause)
@@ -234,10 +769,12 @@ void MusicPlayer::pause(bool do_pause)
     else
         audio_player.resume();
     paused = do_pause;
+    if (!do_pause) wakeDecoder();
 }
 
 std::string MusicPlayer::getMeta(const std::string& what)
 {
+    std::scoped_lock lock{ decodeMutex, playerMutex };
     if (what == "message") {
         return message;
     } else if (what == "sub_title") {
@@ -276,11 +813,8 @@ std::vector<std::string> MusicPlayer::getSecondaryFiles(const std::string& name)
             return lib_files;
         }
 
-        for (auto& plugin : musix::ChipPlugin::getPlugins()) {
-            if (plugin->canHandle(name)) {
-                return plugin->getSecondaryFiles(file);
-            }
-        }
+        auto plugins = PluginRegistry::candidates(name, false);
+        if (!plugins.empty()) return plugins[0]->getSecondaryFiles(file);
     }
     return {};
 }
@@ -288,21 +822,22 @@ std::vector<std::string> MusicPlayer::getSecondaryFiles(const std::string& name)
 // PRIVATE
 
 std::shared_ptr<musix::ChipPlayer>
-MusicPlayer::fromFile(const std::string& file_name)
+MusicPlayer::fromFile(const std::string& file_name, bool& checkSilence,
+                      std::string& pluginName)
 {
-    auto name = file_name;
-    utils::makeLower(name);
-    check_silence = true;
-    LOGD("Finding plugin for '%s' (%s)", file_name, name);
-    for (auto& plugin : musix::ChipPlugin::getPlugins()) {
-        if (plugin->canHandle(name)) {
-            LOGD("Playing with %s\n", plugin->name());
-            auto player =
-                std::shared_ptr<musix::ChipPlayer>(plugin->fromFile(file_name));
-            if (!player) continue;
-            check_silence = plugin->checkSilence();
-            return player;
-        }
+    checkSilence = true;
+    LOGD("Finding plugin for '%s'", file_name);
+    auto plugins = PluginRegistry::candidates(file_name);
+    for (auto& plugin : plugins) {
+        LOGD("Playing with %s\n", plugin->name());
+        auto player =
+            std::shared_ptr<musix::ChipPlayer>(plugin->fromFile(file_name));
+        if (!player) continue;
+        watchMeta(*player);
+        if (plugins.size() > 1) PluginRegistry::loaded(file_name, plugin);
+        checkSilence = plugin->checkSilence();
+        pluginName = plugin->name();
+        return player;
     }
     return nullptr;
 }
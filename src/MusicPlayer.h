@@ -1,11 +1,21 @@
 #pragma once
 
+#include "AudioRing.h"
+#include "BufferTuner.h"
+#include "PcmCache.h"
+#include "Realtime.h"
+#include "Resampler.h"
+#include "SeekCache.h"
 #include "SongInfo.h"
 
 #include <coreutils/fifo.h>
 
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 namespace musix {
@@ -17,10 +27,30 @@ class AudioPlayer;
 
 namespace chipmachine {
 
+class MemFile;
+
 class MusicPlayer
 {
 public:
     explicit MusicPlayer(AudioPlayer& ap);
+
+    // Plugins render at this rate
+    static constexpr int PluginHz = 44100;
+    // Rate of the AudioPlayer and resampler quality used by players created
+    // after this call
+    static void setOutput(int hz, Resampler::Quality quality)
+    {
+        outputHz = hz;
+        outputQuality = quality;
+    }
+    static int getOutputHz() { return outputHz; }
+    // Scheduling of the audio and decode threads of players created after
+    // this call
+    static void setRealtime(Realtime::Options const& options)
+    {
+        realtimeOptions = options;
+    }
+
     MusicPlayer(MusicPlayer const& other) = delete;
     ~MusicPlayer();
     bool playFile(const std::string& fileName);
@@ -29,9 +59,29 @@ public:
     {
         return !play_ended && player != nullptr;
     }
-    void stop() { player = nullptr; }
-    [[nodiscard]] uint32_t getPosition() const { return play_pos / 44100; };
+    void stop()
+    {
+        std::lock_guard lock{ playerMutex };
+        active = false;
+        generation++;
+        player = nullptr;
+        next_player = nullptr;
+        head.clear();
+        next_head.clear();
+        next_cached = nullptr;
+        next_recording = nullptr;
+        finishRecording(false);
+        cached_song = nullptr;
+    }
+    [[nodiscard]] uint32_t getPosition() const
+    {
+        return std::max(play_pos.load(), 0) / hz;
+    };
     [[nodiscard]] uint32_t getLength() const { return length; }
+    // Where the sound of the current (or prepared) song ends, found by
+    // offline analysis. Used when the plugin does not know the length;
+    // decoding then stops there instead of running into silence.
+    void setKnownLength(int ms, bool next = false);
 
     void putStream(const uint8_t* ptr, int size);
     void clearStreamFifo() { stream_fifo->clear(); }
@@ -51,10 +101,19 @@ public:
 
     [[nodiscard]] int getTune() const { return currentTune; }
 
-    [[nodiscard]] SongInfo getPlayingInfo() const { return playing_info; }
+    [[nodiscard]] SongInfo getPlayingInfo() const
+    {
+        std::lock_guard lock{ playerMutex };
+        return playing_info;
+    }
 
     std::string getMeta(const std::string& what);
 
+    // Increases whenever `message`, `sub_title`, `length` or `bitrate` of
+    // the playing song changes, so callers only copy them when needed
+    [[nodiscard]] int getMetaVersion() const { return meta_version; }
+    [[nodiscard]] int getBitrate() const { return bitrate; }
+
     // Returns silence (from now) in seconds
     [[nodiscard]] int getSilence() const;
 
@@ -63,8 +122,30 @@ public:
 
     // Fadeout music
     void fadeOut(float secs);
-    [[nodiscard]] float getFadeVolume() const { return fifo.getVolume(); }
+    [[nodiscard]] float getFadeVolume() const { return fade_volume; }
+
+    // Load the song to play after the current one. It takes over without a
+    // gap when the current song ends (or reaches its length), crossfading
+    // if a crossfade time is set. fadeOut() also hands over to it.
+    bool prepareNext(const std::string& fileName, int tune = -1);
+    void dropNext();
+    [[nodiscard]] bool hasNext() const;
+    // Tune the prepared song will play
+    [[nodiscard]] int getNextTune() const;
+    // Start the prepared song immediately
+    bool playNext();
+    // Number of times a prepared song has taken over (and become audible)
+    [[nodiscard]] int getTransitions() const;
+    void setCrossfade(float secs) { crossfade_frames = secs * PluginHz; }
+
+    // Keep decoded songs on disk, up to `bytes`; 0 turns it off
+    void setSongCache(int64_t bytes);
 
+    // Number of times the audio callback ran out of samples
+    [[nodiscard]] uint32_t getUnderruns() const { return fifo.getUnderruns(); }
+
+    // Decode until the ring is filled. Normally called by the decode
+    // thread, but safe to call from anywhere.
     void update();
 
     void setAudioCallback(const std::function<void(int16_t*, int)>& cb)
@@ -73,34 +154,159 @@ public:
     }
 
 private:
-    std::shared_ptr<musix::ChipPlayer> fromFile(const std::string& fileName);
+    std::shared_ptr<musix::ChipPlayer> fromFile(const std::string& fileName,
+                                                bool& checkSilence,
+                                                std::string& pluginName);
     void updatePlayingInfo();
+    void readMeta();
+    void watchMeta(musix::ChipPlayer& chipPlayer);
+    void decodeLoop();
+    void startNext();
+    void wakeDecoder();
+    void openCached(int tune);
+    void openCache(std::string const& file, int tune,
+                   std::unique_ptr<PcmCache::Song>& cached,
+                   std::unique_ptr<PcmCache::Recording>& rec);
+    void finishRecording(bool ended);
+
+    static inline int outputHz = 44100;
+    static inline Resampler::Quality outputQuality = Resampler::Medium;
+    static inline Realtime::Options realtimeOptions;
+    void reportRealtime();
+    // Output rate; `play_pos` counts frames at this rate, while decoder
+    // side positions like `written_frames` are at PluginHz
+    int hz;
+    Resampler resampler;
 
-    utils::AudioFifo<int16_t> fifo;
+    AudioRing<int16_t> fifo;
+    // How full the decoder keeps `fifo`, in samples, as picked by `tuner`
+    std::atomic<int> fill_target{ 0 };
+    BufferTuner tuner;
+    // Plugins of `player` and `next_player`
+    std::string plugin_name;
+    std::string next_plugin_name;
+    // Decoder buffers, allocated up front so they can be locked in memory
+    std::vector<int16_t> temp_buf;
+    std::vector<int16_t> next_buf;
+    std::vector<int16_t> out_buf;
+    std::atomic<float> fade_volume{ 1.0F };
+    uint32_t reported_underruns = 0;
     SongInfo playing_info;
     // Fifo fifo;
     std::function<void(int16_t*, int)> audio_callback;
 
+    // Only touched by the audio thread until `audio_rt_done` is set
+    bool audio_rt_applied = false;
+    Realtime::Result audio_rt;
+    std::atomic<bool> audio_rt_done{ false };
+    Realtime::Result decode_rt;
+    bool memory_locked = false;
+
     std::atomic<bool> paused{ false };
 
+    // Guards `player` and everything the decoder reads from it. Held while
+    // pushing to `fifo`, which makes the holder its single producer.
+    mutable std::mutex playerMutex;
+    // Held by the decoder while a plugin decodes without `playerMutex`.
+    // Other threads take it, before `playerMutex`, to call into a player
+    // the decoder may be running.
+    std::mutex decodeMutex;
+    // Bumped under `playerMutex` when a chunk decoded without the lock may
+    // no longer fit: seeks, song changes and changes to the next song
+    std::atomic<uint64_t> generation{ 0 };
     std::shared_ptr<musix::ChipPlayer> player;
+
+    // Song that takes over when `player` ends
+    std::shared_ptr<musix::ChipPlayer> next_player;
+    bool next_check_silence = true;
+    int next_tune = 0;
+    // From setKnownLength(), in ms; 0 if unknown
+    int known_length = 0;
+    int next_known_length = 0;
+    // Frames produced by `player` and `next_player`
+    int64_t written_frames = 0;
+    int64_t next_written = 0;
+
+    // Audio a player decoded ahead of time; played before the plugin is
+    // asked for more
+    struct Decoded
+    {
+        std::vector<int16_t> samples;
+        size_t pos = 0;
+
+        // Copy up to `count` samples; they are used up by skip()
+        int peek(int16_t* out, int count) const
+        {
+            int n = (int)std::min<size_t>(count, samples.size() - pos);
+            std::copy_n(samples.data() + pos, n, out);
+            return n;
+        }
+        void skip(int n) { pos += n; }
+        void clear()
+        {
+            samples.clear();
+            pos = 0;
+        }
+    };
+    // Chunks prepareNext() decodes, so the handover never waits for the
+    // plugin to get going
+    static constexpr int PrepareChunks = 2;
+    // Of `player`, left over from when it was `next_player`
+    Decoded head;
+    Decoded next_head;
+    // Audio `player` has produced; the plugin is always at its end()
+    SeekCache seek_cache;
+
+    // Decoded songs on disk. When `cached_song` is set it plays instead of
+    // the plugin, which is only used for meta data. Otherwise the song is
+    // recorded into the cache as it is decoded.
+    PcmCache song_cache;
+    std::unique_ptr<PcmCache::Song> cached_song;
+    std::unique_ptr<PcmCache::Recording> recording;
+    // The same for `next_player`, opened by prepareNext()
+    std::unique_ptr<PcmCache::Song> next_cached;
+    std::unique_ptr<PcmCache::Recording> next_recording;
+    std::string song_file;
+    std::string next_file;
+    // Song unpacked from an archive
+    std::shared_ptr<MemFile> extracted;
+    // Frame where the current song ends, 0 if unknown
+    int64_t song_end = 0;
+    // Frame of `player` where the handover (crossfade) started, or -1
+    int64_t xfade_start = -1;
+    std::atomic<int64_t> crossfade_frames{ 0 };
+    std::atomic<int> transitions{ 0 };
     std::string message;
     std::string sub_title;
+    // Length reported by the plugin; `length` may come from analysis
+    int plugin_length = 0;
+    std::atomic<int> bitrate{ 0 };
+    // Set by plugins when metadata changes, cleared by readMeta()
+    std::atomic<bool> meta_changed{ true };
+    std::atomic<int> meta_version{ 0 };
     std::atomic<int> play_pos{ 0 };
     std::atomic<int> length{ 0 };
     int fade_length = 0;
     int fadeout_pos = 0;
-    int silent_frames = 0;
+    std::atomic<int> silent_frames{ 0 };
     int currentTune = 0;
     std::atomic<float> volume = 1.0F;
 
     // Feed silence to audio player
     std::atomic<bool> dont_play{ false };
     std::atomic<bool> play_ended{ false };
+    // A song is loaded and should be producing audio
+    std::atomic<bool> active{ false };
     bool check_silence = true;
 
     std::shared_ptr<utils::Fifo<uint8_t>> stream_fifo;
 
     AudioPlayer& audio_player;
+
+    std::mutex wakeMutex;
+    std::condition_variable wakeCond;
+    std::atomic<bool> quitDecoder{ false };
+    // Last member; started when everything else is constructed
+    std::thread decodeThread;
 };
 } // namespace chipmachine
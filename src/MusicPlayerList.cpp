@@ -1,8 +1,10 @@
 #include "MusicPlayerList.h"
 
 #include <algorithm>
+#include <filesystem>
 #include <coreutils/log.h>
 #include <coreutils/utils.h>
+#include <set>
 #include <unordered_map>
 
 #include <coreutils/environment.h>
@@ -16,42 +18,28 @@ MusicPlayerList::MusicPlayerList(MusicDatabase& mdb, RemoteLoader& rl,
                                  AudioPlayer& ap)
     : mp(ap), remoteLoader(rl), musicDatabase(mdb)
 {
+    // Commands are handled as soon as they arrive; the timeout only drives
+    // the state machine (song end, fading) when nothing else happens
     playerThread = std::thread([=] {
         while (!quitThread) {
-            plMutex.lock();
-            if (!funcs.empty()) {
-                auto q = funcs;
-                funcs.clear();
-                plMutex.unlock();
-                for (auto& f : q)
-                    f();
-            } else
-                plMutex.unlock();
+            commands.run();
             update();
-            sleepms(50);
+            commands.waitFor(std::chrono::milliseconds(50));
         }
     });
 }
 
 void MusicPlayerList::wait()
 {
-    if (funcs.empty()) {
-        onThisThread([=] {});
-    }
-    plMutex.lock();
-    while (!funcs.empty()) {
-        plMutex.unlock();
-        sleepms(1);
-        plMutex.lock();
-    }
-    plMutex.unlock();
+    // Publish so the effects of those commands are visible to the caller
+    onThisThread([this] { publishStatus(); }).wait();
 }
 
-void MusicPlayerList::addSong(const SongInfo& si, bool shuffle)
+std::future<void> MusicPlayerList::addSong(const SongInfo& si, bool shuffle)
 {
 
     // LOCK_GUARD(plMutex);
-    onThisThread([=] {
+    return onThisThread([=] {
         if (shuffle) {
             playList.insertAt(rand() % (playList.size() + 1), si);
         } else {
@@ -62,16 +50,22 @@ void MusicPlayerList::addSong(const SongInfo& si, bool shuffle)
     // return true;
 }
 
-void MusicPlayerList::clearSongs()
+std::future<void>
+MusicPlayerList::addSongs(const MusicDatabase::SongSource& source)
+{
+    return onThisThread([=] { playList.setSource(source); });
+}
+
+std::future<void> MusicPlayerList::clearSongs()
 {
     // LOCK_GUARD(plMutex);
-    onThisThread([=] { playList.clear(); });
+    return onThisThread([=] { playList.clear(); });
 }
 
-void MusicPlayerList::nextSong()
+std::future<void> MusicPlayerList::nextSong()
 {
     // LOCK_GUARD(plMutex);
-    onThisThread([=] {
+    return onThisThread([=] {
         if (playList.size() > 0) {
             // mp.stop();
             SET_STATE(Waiting);
@@ -79,17 +73,17 @@ void MusicPlayerList::nextSong()
     });
 }
 
-void MusicPlayerList::playSong(const SongInfo& si)
+std::future<void> MusicPlayerList::playSong(const SongInfo& si)
 {
-    onThisThread([=] {
+    return onThisThread([=] {
         dbInfo = currentInfo = si;
         SET_STATE(Playnow);
     });
 }
 
-void MusicPlayerList::seek(int song, int seconds)
+std::future<void> MusicPlayerList::seek(int song, int seconds)
 {
-    onThisThread([=] {
+    return onThisThread([=] {
         if (!multiSongs.empty()) {
             LOGD("CHANGED MULTI");
             state = Playmulti;
@@ -97,37 +91,40 @@ void MusicPlayerList::seek(int song, int seconds)
             return;
         }
         mp.seek(song, seconds);
-        if (song >= 0) changedSong = true;
+        if (song >= 0) {
+            changedSong = true;
+            mp.setKnownLength(analyzedLength(playingFile, song));
+        }
     });
 }
 
 SongInfo MusicPlayerList::getInfo(int index) const
 {
+    auto s = getStatus();
+    if (index == 0) return s->current;
+    if (index == 1) return s->next;
     LOCK_GUARD(plMutex);
-    if (index == 0) return currentInfo;
     return playList.getSong(index - 1);
 }
 
 SongInfo MusicPlayerList::getDBInfo() const
 {
-    LOCK_GUARD(plMutex);
-    return dbInfo;
+    return getStatus()->db;
 }
 
 int MusicPlayerList::getLength() const
 {
-    return playerLength;
+    return getStatus()->length;
 }
 
 int MusicPlayerList::getPosition() const
 {
-    return playerPosition;
+    return getStatus()->position;
 }
 
 int MusicPlayerList::listSize() const
 {
-    LOCK_GUARD(plMutex);
-    return playList.size();
+    return getStatus()->listSize;
 }
 
 /// PRIVATE
@@ -155,23 +152,68 @@ bool MusicPlayerList::handlePlaylist(const std::string& fileName)
         std::remove_if(lines.begin(), lines.end(),
                        [=](const std::string& l) { return l[0] == ';'; }),
         lines.end());
-    for (const std::string& s : lines) {
-        playList.push_back(SongInfo(s));
-    }
+    // Local playlists may contain removal entries
+    auto songs = MusicDatabase::Playlist::replay(lines);
 
-    if (playList.size() == 0) return false;
+    if (songs.empty()) return false;
 
-    musicDatabase.lookup(playList.front());
-    if (playList.front().path == "") {
-        LOGD("Could not lookup '%s'", playList.front().path);
+    // First song is needed now, the rest are resolved in the background
+    musicDatabase.lookup(songs.front());
+    if (songs.front().path == "") {
+        LOGD("Could not lookup '%s'", songs.front().path);
         errors.emplace_back("Bad song in playlist");
         SET_STATE(Error);
         return false;
     }
+    for (const auto& song : songs)
+        playList.push_back(song);
+    songs.erase(songs.begin());
+    resolveInBackground(std::move(songs));
+
     SET_STATE(Waiting);
     return true;
 }
 
+void MusicPlayerList::resolveInBackground(std::vector<SongInfo> songs)
+{
+    if (songs.empty()) return;
+    // Never wait for a job here, they report back through onThisThread()
+    auto done = [](const std::future<void>& f) {
+        return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    };
+    resolveJobs.erase(
+        std::remove_if(resolveJobs.begin(), resolveJobs.end(), done),
+        resolveJobs.end());
+    resolveJobs.push_back(std::async(std::launch::async, [=]() mutable {
+        auto original = songs;
+        musicDatabase.lookup(songs);
+        // Update the entries that are still in the queue
+        onThisThread([=] {
+            std::unordered_map<std::string, const SongInfo*> resolved;
+            for (size_t i = 0; i < songs.size(); i++)
+                resolved[original[i].path] = &songs[i];
+            for (auto& s : playList.songs) {
+                auto it = resolved.find(s.path);
+                if (it != resolved.end()) {
+                    auto tune = s.starttune;
+                    s = *it->second;
+                    s.starttune = tune;
+                }
+            }
+            playList.updated = true;
+        });
+    }));
+}
+
+// Look up the next song if resolveInBackground() has not got to it yet;
+// songs from searches come with their info already
+void MusicPlayerList::resolveFront()
+{
+    if (playList.size() == 0) return;
+    auto& next = playList.front();
+    if (next.title.empty() && next.format.empty()) musicDatabase.lookup(next);
+}
+
 bool MusicPlayerList::playFile(utils::path fileName)
 {
     if (fileName == "") return false;
@@ -218,6 +260,8 @@ bool MusicPlayerList::playFile(utils::path fileName)
 
     if (mp.playFile(fileName.string())) {
         if (currentInfo.starttune >= 0) mp.seek(currentInfo.starttune);
+        playingFile = fileName.string();
+        mp.setKnownLength(analyzedLength(playingFile, mp.getTune()));
         changedSong = false;
         LOGD("CHANGED MULTI:%s", changedMulti ? "YES" : "NO");
         if (!changedMulti) {
@@ -247,10 +291,11 @@ void MusicPlayerList::update()
 
     LOCK_GUARD(plMutex);
 
-    mp.update();
-
+    // Decoding happens on the MusicPlayer decode thread
     remoteLoader.update();
 
+    prefetch();
+
     if (state == Playnow) {
         SET_STATE(Started);
         // LOGD("##### PLAY NOW: %s (%s)", currentInfo.path,
@@ -267,14 +312,21 @@ void MusicPlayerList::update()
         playCurrent();
     }
 
+    if (mp.getTransitions() != seenTransitions) nextStarted();
+
     if (state == Playing || state == Playstarted) {
 
+        prepareNext();
+
         auto pos = mp.getPosition();
         auto length = mp.getLength();
 
         if (cueSheet) {
-            subtitle = cueSheet->getTitle(pos);
-            subtitlePtr = subtitle.c_str();
+            auto title = cueSheet->getTitle(pos);
+            if (title != subtitle) {
+                subtitle = title;
+                metaVersion++;
+            }
         }
 
         if (!changedSong && playList.size() > 0) {
@@ -283,7 +335,9 @@ void MusicPlayerList::update()
                     SET_STATE(Stopped);
                 else
                     SET_STATE(Waiting);
-            } else if ((length > 0 && pos > length) && pos > 7) {
+            } else if ((length > 0 && pos > length) && pos > 7 &&
+                       !mp.hasNext()) {
+                // With a prepared song the player hands over by itself
                 LOGD("STATE: Song length exceeded");
                 mp.fadeOut(3.0);
                 SET_STATE(Fading);
@@ -291,7 +345,7 @@ void MusicPlayerList::update()
                        pos > 7) {
                 LOGD("STATE: Silence detected");
                 mp.fadeOut(0.5);
-                SET_STATE(Fading);
+                if (!mp.hasNext()) SET_STATE(Fading);
             }
         }
     }
@@ -313,16 +367,19 @@ void MusicPlayerList::update()
         }
     }
 
+    if (state == Waiting && playList.size() > 0 &&
+        playList.front().path == preparedPath && mp.playNext()) {
+        LOGD("Next song from queue was prepared");
+        nextStarted();
+    }
+
     if (state == Waiting && (playList.size() > 0)) {
         SET_STATE(Started);
         playedNext = true;
         dbInfo = currentInfo = playList.front();
         playList.pop_front();
 
-        if (playList.size() > 0) {
-            // Update info for next song from
-            musicDatabase.lookup(playList.front());
-        }
+        resolveFront();
 
         // pos = 0;
         LOGD("Next song from queue : %s (%d)", currentInfo.path,
@@ -331,27 +388,220 @@ void MusicPlayerList::update()
         playCurrent();
     }
 
-    // Cache values for outside access
+    // Only copy metadata when the player reports a change
+    if (mp.getMetaVersion() != seenMeta) {
+        seenMeta = mp.getMetaVersion();
+        bitRate = mp.getBitrate();
+        message = mp.getMeta("message");
+        if (!cueSheet) subtitle = mp.getMeta("sub_title");
+        metaVersion++;
+    }
+
+    publishStatus();
+}
+
+void MusicPlayerList::publishStatus()
+{
+    auto s = std::make_shared<Status>();
+    s->version = status->version + 1;
+    s->state = state;
+    s->current = currentInfo;
+    s->db = dbInfo;
+    if (playList.size() > 0) s->next = playList.getSong(0);
+    s->listSize = (int)playList.size();
+    s->position = mp.getPosition();
+    s->length = mp.getLength();
+    s->tune = multiSongs.empty() ? mp.getTune() : multiSongNo;
+    s->bitrate = bitRate;
+    s->playing = mp.playing();
+    s->paused = mp.isPaused();
+    s->volume = mp.getVolume();
+    s->subtitle = subtitle;
+    s->message = message;
+    s->metaVersion = metaVersion;
+    std::atomic_store(&status, std::shared_ptr<Status const>(std::move(s)));
+}
+
+// Load the next queued song into the player shortly before the current one
+// ends, so it can start without a gap
+void MusicPlayerList::prepareNext()
+{
+    std::string next;
+    if (playList.size() > 0 && multiSongs.empty() && !changedSong)
+        next = playList.front().path;
+    if (next == preparedPath) return;
+
+    if (!preparedPath.empty()) {
+        LOGD("Queue changed, dropping prepared song");
+        mp.dropNext();
+        preparedPath = "";
+        preparedFiles.clear();
+    }
 
-    playerPosition = mp.getPosition();
-    playerLength = mp.getLength(); // currentInfo.length;
+    int length = mp.getLength();
+    // Without a length, get ready once the song goes quiet; the silence
+    // detection ends it a few seconds later
+    int silence = detectSilence ? mp.getSilence() : 0;
+    bool ending = length > 0 ? length - (int)mp.getPosition() <= PrepareSeconds
+                             : silence > 44100 * PrepareSilence;
+    if (next.empty() || !ending) return;
+    preparedPath = next;
+
+    // Only plain song files; anything else starts the normal way
+    auto const& info = playList.front();
+    auto parts = split(next, "::", 2);
+    static const std::set<std::string> prefixes = {
+        "index", "product", "playlist", "smart", "pouet", "bitjam", "demovibes"
+    };
+    static const std::set<std::string> exts = { "mp3", "m3u", "pls",
+                                                "plist", "jb", "rar" };
+    if ((parts.size() == 2 && prefixes.count(parts[0]) > 0) ||
+        next.find("MULTI:") != std::string::npos ||
+        exts.count(toLower(path_extension(next))) > 0 ||
+        toLower(info.format) == "mp3" || info.format == "M3U" ||
+        info.format == "PLS")
+        return;
 
-    if (!multiSongs.empty())
-        currentTune = multiSongNo;
+    auto nextInfo = info;
+    auto prepare = [=](File f) {
+        // Queue may have changed while loading
+        if (!f || preparedPath != next) return;
+        if (!mp.getSecondaryFiles(f).empty()) return;
+        if (mp.prepareNext(f.getName(), nextInfo.starttune)) {
+            mp.setKnownLength(analyzedLength(f.getName(), mp.getNextTune()),
+                              true);
+            LOGD("Prepared next song '%s'", next);
+            preparedInfo = nextInfo;
+            preparedFiles = { f };
+        }
+    };
+    if (utils::exists(next))
+        prepare(File(next));
     else
-        currentTune = mp.getTune();
+        remoteLoader.load(next, prepare);
+}
 
-    playing = mp.playing();
-    paused = mp.isPaused();
-    auto br = mp.getMeta("bitrate");
-    if (br != "") {
-        bitRate = std::stol(br);
+// Files that will be needed by the next few songs in the queue
+std::vector<std::string> MusicPlayerList::upcomingFiles() const
+{
+    static const std::set<std::string> prefixes = {
+        "index", "product", "playlist", "smart", "pouet"
+    };
+    // Streamed, not cached
+    static const std::set<std::string> exts = { "mp3", "m3u", "pls" };
+
+    std::vector<std::string> result;
+    for (size_t i = 0; i < playList.size() && (int)i < prefetchSongs; i++) {
+        auto const& song = playList.getSong(i);
+        std::string prefix;
+        std::string path = song.path;
+        auto parts = split(song.path, "::", 2);
+        if (parts.size() == 2) {
+            prefix = parts[0];
+            path = parts[1];
+        }
+        if (path.empty() || prefixes.count(prefix) > 0 ||
+            exts.count(toLower(path_extension(path))) > 0 ||
+            toLower(song.format) == "mp3")
+            continue;
+        if (startsWith(path, "MULTI:")) {
+            for (auto const& m : split(path.substr(6), "\t"))
+                result.push_back(prefix.empty() ? m : prefix + "::" + m);
+        } else
+            result.push_back(song.path);
     }
+    return result;
+}
+
+void MusicPlayerList::prefetch()
+{
+    if (prefetchSongs <= 0) return;
+    auto files = upcomingFiles();
+    if (files == prefetchPaths) return;
+
+    // Files still in the new list keep downloading
+    remoteLoader.cancelPreCache(files);
+    prefetchPaths = files;
+    prefetchQueue.assign(files.begin(), files.end());
+    prefetchBytes = 0;
+    prefetchGeneration++;
+    prefetching = false;
+    prefetchNext();
+}
+
+void MusicPlayerList::prefetchNext()
+{
+    if (prefetching || prefetchQueue.empty() ||
+        prefetchBytes >= prefetchBudget)
+        return;
+
+    auto path = prefetchQueue.front();
+    prefetchQueue.pop_front();
+    prefetching = true;
+    int generation = prefetchGeneration;
+    remoteLoader.preCache(path, [=](File f) {
+        if (generation != prefetchGeneration) return;
+        prefetching = false;
+        if (f) {
+            std::error_code ec;
+            auto size = std::filesystem::file_size(f.getName(), ec);
+            if (!ec) prefetchBytes += size;
+            LOGD("Prefetched '%s' (%d bytes total)", path, (int)prefetchBytes);
+            // Like PSF _lib files
+            auto parentDir = File(path_directory(f.getName()));
+            for (auto const& s : mp.getSecondaryFiles(f)) {
+                if (!(parentDir / s).exists())
+                    prefetchQueue.push_front(path_directory(path) + "/" + s);
+            }
+        }
+        prefetchNext();
+    });
+}
 
-    if (!cueSheet) {
-        subtitle = mp.getMeta("sub_title");
-        subtitlePtr = subtitle.c_str();
+// Length in ms the renderer found for the subsong, 0 if not analyzed.
+// Silent subsongs are left to the silence detection.
+int MusicPlayerList::analyzedLength(std::string const& file, int tune) const
+{
+    int tunes = 0;
+    int lengthMs = 0;
+    if (file.empty() ||
+        !musicDatabase.getAnalysis(file, tune, tunes, lengthMs))
+        return 0;
+    LOGD("%s (%d) analyzed to end at %dms", file, tune, lengthMs);
+    return std::max(lengthMs, 0);
+}
+
+// The prepared song has taken over in the player
+void MusicPlayerList::nextStarted()
+{
+    seenTransitions = mp.getTransitions();
+    LOGD("Next song started without gap: %s", preparedInfo.path);
+
+    if (playList.size() > 0 && playList.front().path == preparedInfo.path)
+        playList.pop_front();
+    dbInfo = currentInfo = preparedInfo;
+    songFiles = preparedFiles;
+    if (!preparedFiles.empty()) playingFile = preparedFiles[0].getName();
+    preparedPath = "";
+    preparedFiles.clear();
+
+    if (currentInfo.metadata[SongInfo::SCREENSHOT] == "") {
+        auto s = musicDatabase.getSongScreenshots(currentInfo);
+        currentInfo.metadata[SongInfo::SCREENSHOT] = s;
     }
+    musicDatabase.markPlayed(currentInfo);
+
+    cueSheet = nullptr;
+    subtitle = "";
+    detectSilence = true;
+    multiSongs.clear();
+    changedSong = false;
+    playedNext = true;
+    bitRate = 0;
+    updateInfo();
+    SET_STATE(Playstarted);
+
+    resolveFront();
 }
 
 void MusicPlayerList::playCurrent()
@@ -360,6 +610,8 @@ void MusicPlayerList::playCurrent()
     SET_STATE(Loading);
 
     songFiles.clear();
+    preparedPath = "";
+    preparedFiles.clear();
     // screenshot = "";
 
     LOGD("PLAY PATH:%s", currentInfo.path);
@@ -417,6 +669,20 @@ void MusicPlayerList::playCurrent()
         return;
     }
 
+    if (prefix == "smart") {
+        playList.clear();
+        playList.setSource(musicDatabase.smartSongs(path));
+        if (playList.size() == 0) {
+            errors.emplace_back("No songs in smart playlist");
+            SET_STATE(Error);
+            return;
+        }
+        SET_STATE(Waiting);
+        return;
+    }
+
+    musicDatabase.markPlayed(currentInfo);
+
     if (startsWith(path, "MULTI:")) {
         multiSongs = split(path.substr(6), "\t");
         if (prefix != "") {
@@ -439,12 +705,8 @@ void MusicPlayerList::playCurrent()
 
     cueSheet = nullptr;
     subtitle = "";
-    subtitlePtr = subtitle.c_str();
 
-    playerPosition = 0;
-    playerLength = 0;
     bitRate = 0;
-    currentTune = 0;
 
     cancelStreaming();
 
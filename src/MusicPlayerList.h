@@ -1,5 +1,6 @@
 #pragma once
 
+#include "CommandQueue.h"
 #include "CueSheet.h"
 #include "MusicDatabase.h"
 #include "MusicPlayer.h"
@@ -9,6 +10,8 @@
 #include <coreutils/thread.h>
 #include <cstdint>
 #include <deque>
+#include <future>
+#include <type_traits>
 
 struct log_guard
 {
@@ -55,13 +58,50 @@ public:
     ~MusicPlayerList()
     {
         quitThread = true;
+        commands.wake();
         playerThread.join();
     }
 
-    void addSong(const SongInfo& si, bool shuffle = false);
-    void playSong(const SongInfo& si);
-    void clearSongs();
-    void nextSong();
+    // Commands are executed in order on the player thread. The returned
+    // future is ready once the command has been applied.
+    std::future<void> addSong(const SongInfo& si, bool shuffle = false);
+    // Queue songs that are pulled from `source` as they are needed
+    std::future<void> addSongs(const MusicDatabase::SongSource& source);
+    std::future<void> playSong(const SongInfo& si);
+    std::future<void> clearSongs();
+    std::future<void> nextSong();
+
+    // What the UI shows, published by the player thread after every
+    // update. A snapshot is never changed once published, so readers get a
+    // consistent view without waiting for the player thread.
+    struct Status
+    {
+        // Increases with every snapshot
+        uint64_t version = 0;
+        State state = Stopped;
+        SongInfo current;
+        SongInfo db;
+        // First song in the queue, if any
+        SongInfo next;
+        int listSize = 0;
+        int position = 0;
+        int length = 0;
+        int tune = 0;
+        int bitrate = 0;
+        bool playing = false;
+        bool paused = false;
+        float volume = 0;
+        std::string subtitle;
+        std::string message;
+        // Increases when `subtitle`, `message` or `bitrate` change
+        uint64_t metaVersion = 0;
+    };
+
+    // Any thread
+    std::shared_ptr<Status const> getStatus() const
+    {
+        return std::atomic_load(&status);
+    }
 
     SongInfo getInfo(int index = 0) const;
     SongInfo getDBInfo() const;
@@ -69,9 +109,9 @@ public:
     int getPosition() const;
     int listSize() const;
 
-    bool isPlaying() const { return playing; }
+    bool isPlaying() const { return getStatus()->playing; }
 
-    int getTune() const { return currentTune; }
+    int getTune() const { return getStatus()->tune; }
 
     void pause(bool dopause = true)
     {
@@ -79,18 +119,16 @@ public:
         mp.pause(dopause);
     }
 
-    bool isPaused() const { return paused; }
+    bool isPaused() const { return getStatus()->paused; }
 
-    void seek(int song, int seconds = -1);
+    std::future<void> seek(int song, int seconds = -1);
 
-    int getBitrate() const { return bitRate; }
+    int getBitrate() const { return getStatus()->bitrate; }
 
     std::string getMeta(const std::string& what)
     {
-        if (what == "sub_title") {
-            std::string sub = std::string(subtitlePtr);
-            return sub;
-        }
+        if (what == "sub_title") return getStatus()->subtitle;
+        if (what == "message") return getStatus()->message;
         LOCK_GUARD(plMutex);
         LOGD("META %s", what);
         return mp.getMeta(what);
@@ -116,20 +154,38 @@ public:
         return e;
     }
 
-    void setVolume(float volume)
+    std::future<void> setVolume(float volume)
     {
-        onThisThread([=] { mp.setVolume(volume); });
+        return onThisThread([=] { mp.setVolume(volume); });
     }
 
-    float getVolume()
+    // Seconds to crossfade between queued songs; 0 means gapless
+    std::future<void> setCrossfade(float secs)
     {
-        LOCK_GUARD(plMutex);
-        return mp.getVolume();
+        return onThisThread([=] { mp.setCrossfade(secs); });
+    }
+
+    // Keep decoded songs on disk, up to `bytes`; 0 turns it off
+    std::future<void> setSongCache(int64_t bytes)
+    {
+        return onThisThread([=] { mp.setSongCache(bytes); });
+    }
+
+    // Fetch files of the next `songs` queue entries into the cache, until
+    // `bytes` have been fetched. 0 songs turns prefetching off.
+    std::future<void> setPrefetch(int songs, int64_t bytes)
+    {
+        return onThisThread([=] {
+            prefetchSongs = songs;
+            prefetchBudget = bytes;
+        });
     }
 
-    void stop()
+    float getVolume() const { return getStatus()->volume; }
+
+    std::future<void> stop()
     {
-        onThisThread([=] {
+        return onThisThread([=] {
             SET_STATE(Stopped);
             mp.stop();
         });
@@ -146,24 +202,40 @@ public:
 
     bool playlistUpdated() { return playList.wasUpdated(); }
 
+    // Wait until all commands issued so far have been executed and their
+    // effects are in getStatus()
     void wait();
 
 private:
-    void onThisThread(const std::function<void()>& f)
+    template <typename FN>
+    auto onThisThread(FN f) -> std::future<std::invoke_result_t<FN>>
     {
-        LOCK_GUARD(plMutex);
-        funcs.push_back(f);
+        using Result = std::invoke_result_t<FN>;
+        auto task = std::make_shared<std::packaged_task<Result()>>(f);
+        auto result = task->get_future();
+        commands.push([task] { (*task)(); });
+        return result;
     }
 
-    std::vector<std::function<void()>> funcs;
+    CommandQueue commands;
 
     void cancelStreaming();
     bool handlePlaylist(const std::string& fileName);
+    void resolveInBackground(std::vector<SongInfo> songs);
+    void resolveFront();
     void playCurrent();
     bool playFile(utils::path fileName);
+    void prepareNext();
+    void nextStarted();
+    // Stored length of an analyzed local file in ms, 0 if not known
+    int analyzedLength(std::string const& file, int tune) const;
+    std::vector<std::string> upcomingFiles() const;
+    void prefetch();
+    void prefetchNext();
 
     void update();
     void updateInfo();
+    void publishStatus();
 
     std::deque<std::string> errors;
 
@@ -180,6 +252,27 @@ private:
         std::deque<SongInfo> songs;
         std::deque<SongInfo> psongs;
         std::string prodScreenshot;
+        // Songs are pulled from here when the queue runs low
+        MusicDatabase::SongSource source;
+
+        void setSource(const MusicDatabase::SongSource& s)
+        {
+            source = s;
+            refill();
+            updated = true;
+        }
+        void refill()
+        {
+            // Keep the next song visible
+            while (source && songs.size() < 2) {
+                SongInfo song;
+                if (!source(song)) {
+                    source = nullptr;
+                    break;
+                }
+                songs.push_back(song);
+            }
+        }
         [[nodiscard]] size_t size() const
         {
             return songs.size() + psongs.size();
@@ -194,6 +287,7 @@ private:
         {
             psongs.clear();
             songs.clear();
+            source = nullptr;
             updated = true;
         }
         void pop_front()
@@ -202,6 +296,7 @@ private:
                 psongs.pop_front();
             else
                 songs.pop_front();
+            refill();
             updated = true;
         }
         SongInfo& front()
@@ -240,12 +335,9 @@ private:
     std::atomic<bool> wasAllowed{ true };
     std::atomic<bool> quitThread{ false };
 
-    std::atomic<int> currentTune{ 0 };
-    std::atomic<bool> playing{ false };
-    std::atomic<bool> paused{ false };
-    std::atomic<int> bitRate{ 0 };
-    std::atomic<int> playerPosition{ 0 };
-    std::atomic<int> playerLength{ 0 };
+    int bitRate = 0;
+    // Replaced, never modified, by publishStatus()
+    std::shared_ptr<Status const> status = std::make_shared<Status>();
 
     std::atomic<int> files{ 0 };
     std::string loadedFile;
@@ -262,7 +354,10 @@ private:
 
     std::shared_ptr<CueSheet> cueSheet;
     std::string subtitle;
-    std::atomic<const char*> subtitlePtr{ nullptr };
+    std::string message;
+    // Last MusicPlayer::getMetaVersion() copied
+    int seenMeta = -1;
+    uint64_t metaVersion = 0;
 
     int multiSongNo = 0;
     std::vector<std::string> multiSongs;
@@ -270,6 +365,30 @@ private:
     bool playedNext = false;
 
     std::vector<utils::File> songFiles;
+    // Local file of the current song
+    std::string playingFile;
+
+    // Next song in the queue, loaded into the player ahead of time
+    static constexpr int PrepareSeconds = 10;
+    // Seconds of silence before that, for songs of unknown length
+    static constexpr int PrepareSilence = 1;
+    std::string preparedPath;
+    SongInfo preparedInfo;
+    std::vector<utils::File> preparedFiles;
+    int seenTransitions = 0;
+
+    // Files of upcoming songs are fetched one at a time, restarting
+    // whenever the queue changes
+    int prefetchSongs = 3;
+    int64_t prefetchBudget = 64 * 1024 * 1024;
+    std::vector<std::string> prefetchPaths;
+    std::deque<std::string> prefetchQueue;
+    int64_t prefetchBytes = 0;
+    int prefetchGeneration = 0;
+    bool prefetching = false;
+
+    // Declared last so they are waited for before other members go away
+    std::vector<std::future<void>> resolveJobs;
 };
 
 } // namespace chipmachine
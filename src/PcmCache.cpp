@@ -0,0 +1,292 @@
+#include "PcmCache.h"
+#include "SeekCache.h"
+
+#include <coreutils/log.h>
+#include <crypto/md5.h>
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <future>
+
+namespace fs = std::filesystem;
+
+namespace chipmachine {
+
+static constexpr char Magic[8] = { 'C', 'M', 'P', 'C', 'M', 1, 0, 0 };
+
+PcmCache::Song::Song(std::string const& fileName)
+    : in(fileName, std::ios::binary)
+{
+    char magic[8];
+    if (!in.read(magic, 8) || memcmp(magic, Magic, 8) != 0) {
+        in.close();
+        return;
+    }
+    // Index the blocks; each is sample count, size and zlib data
+    uint32_t header[2];
+    while (in.read((char*)header, sizeof(header))) {
+        Block b{ (uint64_t)in.tellg(), header[1], totalFrames,
+                 (int)header[0] / 2 };
+        blocks.push_back(b);
+        totalFrames += b.frames;
+        in.seekg(b.size, std::ios::cur);
+    }
+    in.clear();
+}
+
+int PcmCache::Song::read(int64_t frame, int16_t* out, int count)
+{
+    if (frame < 0 || frame >= totalFrames) return 0;
+    auto it = std::upper_bound(
+        blocks.begin(), blocks.end(), frame,
+        [](int64_t f, Block const& b) { return f < b.frame; });
+    auto index = (size_t)(it - blocks.begin() - 1);
+    auto const& b = blocks[index];
+    if (index != decodedIndex) {
+        packed.resize(b.size);
+        decoded.resize(b.frames * 2);
+        in.seekg(b.offset);
+        if (!in.read((char*)packed.data(), b.size) ||
+            !SeekCache::unpack(packed.data(), b.size, decoded)) {
+            LOGE("Could not read cached song block %d", (int)index);
+            in.clear();
+            std::fill(decoded.begin(), decoded.end(), 0);
+        }
+        decodedIndex = index;
+    }
+    auto pos = (size_t)(frame - b.frame) * 2;
+    int n = (int)std::min<size_t>(count & ~1, decoded.size() - pos);
+    memcpy(out, &decoded[pos], n * 2);
+    return n;
+}
+
+PcmCache::Recording::Recording(PcmCache& cache, std::string fileName)
+    : cache(cache), output(std::make_shared<Output>())
+{
+    output->fileName = std::move(fileName);
+    pending.reserve(SeekCache::BlockFrames * 2);
+}
+
+PcmCache::Recording::~Recording()
+{
+    if (committed) return;
+    cache.jobs.push([&cache = cache, output = output] {
+        cache.discard(*output);
+    });
+}
+
+void PcmCache::Recording::append(int64_t frame, int16_t const* samples,
+                                 int count)
+{
+    if (broken) return;
+    if (frame != totalFrames) {
+        broken = true;
+        return;
+    }
+    while (count > 0) {
+        int n = std::min<int>(count, SeekCache::BlockFrames * 2 -
+                                         (int)pending.size());
+        pending.insert(pending.end(), samples, samples + n);
+        samples += n;
+        count -= n;
+        totalFrames += n / 2;
+        if ((int)pending.size() == SeekCache::BlockFrames * 2) queueBlock();
+        if (broken) return;
+    }
+}
+
+void PcmCache::Recording::queueBlock()
+{
+    if (cache.queuedBlocks >= MaxQueuedBlocks) {
+        LOGI("Song cache can not keep up, dropping recording");
+        broken = true;
+        return;
+    }
+    cache.queuedBlocks++;
+    cache.jobs.push([&cache = cache, output = output,
+                     samples = std::move(pending)] {
+        cache.writeBlock(*output, samples);
+        cache.queuedBlocks--;
+    });
+    pending = {};
+    pending.reserve(SeekCache::BlockFrames * 2);
+}
+
+void PcmCache::Recording::commit()
+{
+    if (committed || broken || totalFrames == 0) return;
+    committed = true;
+    cache.jobs.push([&cache = cache, output = output,
+                     samples = std::move(pending), frames = totalFrames] {
+        if (!samples.empty()) cache.writeBlock(*output, samples);
+        cache.finish(*output, frames);
+    });
+}
+
+PcmCache::PcmCache(std::string dir) : dir(std::move(dir))
+{
+    writer = std::thread([this] {
+        while (!quit) {
+            jobs.run();
+            jobs.waitFor(std::chrono::seconds(1));
+        }
+        // Recordings committed while shutting down still get stored
+        jobs.run();
+    });
+}
+
+PcmCache::~PcmCache()
+{
+    quit = true;
+    jobs.wake();
+    writer.join();
+}
+
+void PcmCache::flush()
+{
+    std::promise<void> done;
+    jobs.push([&done] { done.set_value(); });
+    done.get_future().wait();
+}
+
+void PcmCache::writeBlock(Output& output, std::vector<int16_t> const& samples)
+{
+    if (output.failed) return;
+    if (!output.out.is_open()) {
+        std::error_code ec;
+        fs::create_directories(dir, ec);
+        output.out.open(output.fileName + ".tmp", std::ios::binary);
+        output.out.write(Magic, 8);
+    }
+    if (!SeekCache::pack(samples.data(), samples.size(), output.packed)) {
+        output.failed = true;
+        return;
+    }
+    uint32_t header[2] = { (uint32_t)samples.size(),
+                           (uint32_t)output.packed.size() };
+    output.out.write((char const*)header, sizeof(header));
+    output.out.write((char const*)output.packed.data(), output.packed.size());
+    if (!output.out) output.failed = true;
+}
+
+void PcmCache::finish(Output& output, int64_t frames)
+{
+    output.out.close();
+    if (output.failed || output.out.fail()) {
+        discard(output);
+        return;
+    }
+    std::error_code ec;
+    fs::rename(output.fileName + ".tmp", output.fileName, ec);
+    if (ec) {
+        discard(output);
+        return;
+    }
+    LOGD("Cached %d seconds of audio in %s",
+         (int)(frames / SeekCache::BlockFrames), output.fileName);
+    added(output.fileName);
+}
+
+void PcmCache::discard(Output& output)
+{
+    if (output.out.is_open()) output.out.close();
+    std::error_code ec;
+    fs::remove(output.fileName + ".tmp", ec);
+}
+
+void PcmCache::setBudget(int64_t bytes)
+{
+    budget = bytes;
+    if (bytes <= 0) return;
+    std::lock_guard lock{ cacheMutex };
+    scan();
+    trim();
+}
+
+std::string PcmCache::cacheName(std::string const& file, int tune) const
+{
+    // Same file contents are likely at the same path with the same size
+    std::error_code ec;
+    auto path = fs::absolute(file, ec).lexically_normal().string();
+    auto size = fs::file_size(file, ec);
+    auto hash = MD5::hash(path + ":" + std::to_string(ec ? 0 : size));
+    return (fs::path(dir) /
+            (std::to_string(hash) + "_" + std::to_string(tune) + ".pcm"))
+        .string();
+}
+
+std::unique_ptr<PcmCache::Song> PcmCache::open(std::string const& file,
+                                               int tune)
+{
+    if (!enabled()) return nullptr;
+    auto name = cacheName(file, tune);
+    std::error_code ec;
+    if (!fs::exists(name, ec)) return nullptr;
+    auto song = std::make_unique<Song>(name);
+    if (!*song || song->frames() == 0) return nullptr;
+    // Modification time orders the files for eviction
+    fs::last_write_time(name, fs::file_time_type::clock::now(), ec);
+    return song;
+}
+
+std::unique_ptr<PcmCache::Recording> PcmCache::record(std::string const& file,
+                                                      int tune)
+{
+    if (!enabled()) return nullptr;
+    return std::make_unique<Recording>(*this, cacheName(file, tune));
+}
+
+void PcmCache::added(std::string const& fileName)
+{
+    std::lock_guard lock{ cacheMutex };
+    scan();
+    std::error_code ec;
+    totalBytes += (int64_t)fs::file_size(fileName, ec);
+    trim();
+}
+
+void PcmCache::scan()
+{
+    if (scanned) return;
+    scanned = true;
+    totalBytes = 0;
+    std::error_code ec;
+    for (auto const& e : fs::directory_iterator(dir, ec)) {
+        if (e.path().extension() == ".pcm")
+            totalBytes += (int64_t)e.file_size(ec);
+        else if (e.path().extension() == ".tmp")
+            // Left behind by a crash
+            fs::remove(e.path(), ec);
+    }
+}
+
+void PcmCache::trim()
+{
+    if (totalBytes <= budget) return;
+    struct Entry
+    {
+        fs::path path;
+        fs::file_time_type time;
+        int64_t size;
+    };
+    std::vector<Entry> entries;
+    std::error_code ec;
+    for (auto const& e : fs::directory_iterator(dir, ec)) {
+        if (e.path().extension() != ".pcm") continue;
+        entries.push_back(
+            { e.path(), e.last_write_time(ec), (int64_t)e.file_size(ec) });
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](auto const& a, auto const& b) { return a.time < b.time; });
+    totalBytes = 0;
+    for (auto const& e : entries)
+        totalBytes += e.size;
+    for (auto const& e : entries) {
+        if (totalBytes <= budget) break;
+        if (fs::remove(e.path, ec)) totalBytes -= e.size;
+    }
+    LOGD("Song cache trimmed to %d KB", (int)(totalBytes / 1024));
+}
+
+} // namespace chipmachine
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CommandQueue.h"
+
+namespace chipmachine {
+
+// On disk cache of decoded songs, so replaying a song does not have to run
+// the emulator again. Each subsong is one file of compressed one second
+// blocks (see SeekCache). The least recently played files are removed to
+// stay within the size budget. Packing, writing and trimming happen on a
+// writer thread, so recording costs the decoder no disk access.
+class PcmCache
+{
+    // The file of a recording; only touched by the writer thread
+    struct Output
+    {
+        std::string fileName;
+        std::ofstream out;
+        std::vector<uint8_t> packed;
+        bool failed = false;
+    };
+
+public:
+    // A cached song, read back
+    class Song
+    {
+    public:
+        explicit Song(std::string const& fileName);
+        explicit operator bool() const { return (bool)in; }
+
+        [[nodiscard]] int64_t frames() const { return totalFrames; }
+
+        // Read up to `count` samples from `frame`; returns 0 at the end
+        int read(int64_t frame, int16_t* out, int count);
+
+    private:
+        struct Block
+        {
+            uint64_t offset;
+            uint32_t size;
+            // First frame in block
+            int64_t frame;
+            int frames;
+        };
+        std::ifstream in;
+        std::vector<Block> blocks;
+        int64_t totalFrames = 0;
+
+        size_t decodedIndex = SIZE_MAX;
+        std::vector<uint8_t> packed;
+        std::vector<int16_t> decoded;
+    };
+
+    // A song being decoded, written to the cache once it is complete
+    class Recording
+    {
+    public:
+        Recording(PcmCache& cache, std::string fileName);
+        ~Recording();
+        Recording(Recording const&) = delete;
+
+        // Add `count` samples decoded at `frame`. A gap or overlap makes
+        // the recording useless, since it must start at the beginning.
+        void append(int64_t frame, int16_t const* samples, int count);
+
+        [[nodiscard]] int64_t frames() const { return totalFrames; }
+
+        // Store in the cache; otherwise the recording is thrown away
+        void commit();
+
+    private:
+        void queueBlock();
+
+        PcmCache& cache;
+        std::shared_ptr<Output> output;
+        std::vector<int16_t> pending;
+        int64_t totalFrames = 0;
+        bool broken = false;
+        bool committed = false;
+    };
+
+    explicit PcmCache(std::string dir);
+    ~PcmCache();
+    PcmCache(PcmCache const&) = delete;
+
+    // 0 disables the cache
+    void setBudget(int64_t bytes);
+    [[nodiscard]] bool enabled() const { return budget > 0; }
+
+    // Returns nullptr if the subsong is not cached
+    std::unique_ptr<Song> open(std::string const& file, int tune);
+    std::unique_ptr<Recording> record(std::string const& file, int tune);
+
+    // Wait until everything queued for the writer is on disk
+    void flush();
+
+private:
+    // Blocks waiting for the writer before recordings are dropped, so a
+    // stalled disk can not eat all memory (a block is one second)
+    static constexpr int MaxQueuedBlocks = 32;
+
+    std::string cacheName(std::string const& file, int tune) const;
+    void writeBlock(Output& output, std::vector<int16_t> const& samples);
+    void finish(Output& output, int64_t frames);
+    void discard(Output& output);
+    void added(std::string const& fileName);
+    void scan();
+    void trim();
+
+    std::string dir;
+    std::atomic<int64_t> budget{ 0 };
+    std::mutex cacheMutex;
+    bool scanned = false;
+    int64_t totalBytes = 0;
+
+    CommandQueue jobs;
+    std::atomic<int> queuedBlocks{ 0 };
+    std::atomic<bool> quit{ false };
+    std::thread writer;
+};
+
+} // namespace chipmachine
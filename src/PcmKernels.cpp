@@ -0,0 +1,203 @@
+#include "PcmKernels.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#    define PCM_HAVE_AVX2 1
+#    include <immintrin.h>
+#elif defined(__SSE2__)
+#    include <emmintrin.h>
+#endif
+
+namespace chipmachine {
+
+static int16_t saturate(float v)
+{
+    return (int16_t)std::clamp(v, -32768.0F, 32767.0F);
+}
+
+static void gainRampScalar(int16_t* ptr, int count, float from, float step)
+{
+    for (int i = 0; i < count; i++)
+        ptr[i] = saturate(ptr[i] * (from + step * (float)(i / 2)));
+}
+
+static bool quiet(int16_t v, int level)
+{
+    return std::abs(v) < level;
+}
+
+static int trailingQuietScalar(int16_t const* ptr, int count, int level)
+{
+    int i = count;
+    while (i > 0 && quiet(ptr[i - 1], level))
+        i--;
+    return count - i;
+}
+
+#ifdef __SSE2__
+static void gainRampSSE2(int16_t* ptr, int count, float from, float step)
+{
+    // Gain per lane; both samples of a frame share one
+    __m128 g0 = _mm_add_ps(
+        _mm_set1_ps(from),
+        _mm_mul_ps(_mm_set1_ps(step), _mm_setr_ps(0, 0, 1, 1)));
+    __m128 g1 = _mm_add_ps(g0, _mm_set1_ps(step * 2));
+    __m128 inc = _mm_set1_ps(step * 4);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        auto* p = (__m128i*)(ptr + i);
+        __m128i x = _mm_loadu_si128(p);
+        // Sign extend to 32 bits
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        lo = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(lo), g0));
+        hi = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(hi), g1));
+        _mm_storeu_si128(p, _mm_packs_epi32(lo, hi));
+        g0 = _mm_add_ps(g0, inc);
+        g1 = _mm_add_ps(g1, inc);
+    }
+    gainRampScalar(ptr + i, count - i, from + step * (float)(i / 2), step);
+}
+
+static int trailingQuietSSE2(int16_t const* ptr, int count, int level)
+{
+    __m128i low = _mm_set1_epi16((int16_t)-level);
+    __m128i high = _mm_set1_epi16((int16_t)level);
+    int i = count;
+    for (; i >= 8; i -= 8) {
+        __m128i x = _mm_loadu_si128((__m128i const*)(ptr + i - 8));
+        __m128i in = _mm_and_si128(_mm_cmpgt_epi16(x, low),
+                                   _mm_cmplt_epi16(x, high));
+        if (_mm_movemask_epi8(in) != 0xffff) break;
+    }
+    // Finish inside the block that was not all quiet
+    return count - i + trailingQuietScalar(ptr, i, level);
+}
+#endif
+
+#ifdef PCM_HAVE_AVX2
+__attribute__((target("avx2"))) static void
+gainRampAVX2(int16_t* ptr, int count, float from, float step)
+{
+    __m256 g0 = _mm256_add_ps(
+        _mm256_set1_ps(from),
+        _mm256_mul_ps(_mm256_set1_ps(step),
+                      _mm256_setr_ps(0, 0, 1, 1, 2, 2, 3, 3)));
+    __m256 g1 = _mm256_add_ps(g0, _mm256_set1_ps(step * 4));
+    __m256 inc = _mm256_set1_ps(step * 8);
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        auto* p = (__m256i*)(ptr + i);
+        __m256i x = _mm256_loadu_si256(p);
+        __m256i lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(x));
+        __m256i hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(x, 1));
+        lo = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(lo), g0));
+        hi = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(hi), g1));
+        // packs works per 128 bit lane, so put the quadwords back in order
+        __m256i packed = _mm256_packs_epi32(lo, hi);
+        _mm256_storeu_si256(p, _mm256_permute4x64_epi64(packed, 0xd8));
+        g0 = _mm256_add_ps(g0, inc);
+        g1 = _mm256_add_ps(g1, inc);
+    }
+    gainRampScalar(ptr + i, count - i, from + step * (float)(i / 2), step);
+}
+
+__attribute__((target("avx2"))) static int
+trailingQuietAVX2(int16_t const* ptr, int count, int level)
+{
+    __m256i low = _mm256_set1_epi16((int16_t)-level);
+    __m256i high = _mm256_set1_epi16((int16_t)level);
+    int i = count;
+    for (; i >= 16; i -= 16) {
+        __m256i x = _mm256_loadu_si256((__m256i const*)(ptr + i - 16));
+        __m256i in = _mm256_and_si256(_mm256_cmpgt_epi16(x, low),
+                                      _mm256_cmpgt_epi16(high, x));
+        if (_mm256_movemask_epi8(in) != -1) break;
+    }
+    return count - i + trailingQuietScalar(ptr, i, level);
+}
+#endif
+
+struct Kernels
+{
+    PcmIsa isa;
+    void (*gainRamp)(int16_t*, int, float, float);
+    int (*trailingQuiet)(int16_t const*, int, int);
+};
+
+static Kernels const scalarKernels{ PcmIsa::Scalar, gainRampScalar,
+                                    trailingQuietScalar };
+#ifdef __SSE2__
+static Kernels const sse2Kernels{ PcmIsa::SSE2, gainRampSSE2,
+                                  trailingQuietSSE2 };
+#endif
+#ifdef PCM_HAVE_AVX2
+static Kernels const avx2Kernels{ PcmIsa::AVX2, gainRampAVX2,
+                                  trailingQuietAVX2 };
+#endif
+
+static Kernels const* bestKernels(PcmIsa wanted)
+{
+#ifdef PCM_HAVE_AVX2
+    if (wanted >= PcmIsa::AVX2 && __builtin_cpu_supports("avx2")) {
+        return &avx2Kernels;
+    }
+#endif
+#ifdef __SSE2__
+    if (wanted >= PcmIsa::SSE2) return &sse2Kernels;
+#endif
+    return &scalarKernels;
+}
+
+static std::atomic<Kernels const*> active{ nullptr };
+
+static Kernels const& kernels()
+{
+    auto* k = active.load(std::memory_order_acquire);
+    if (k == nullptr) {
+        k = bestKernels(PcmIsa::AVX2);
+        active.store(k, std::memory_order_release);
+    }
+    return *k;
+}
+
+void pcmGainRamp(int16_t* ptr, int count, float from, float to)
+{
+    int frames = count / 2;
+    float step = frames > 0 ? (to - from) / (float)frames : 0.0F;
+    kernels().gainRamp(ptr, count, from, step);
+}
+
+int pcmTrailingQuiet(int16_t const* ptr, int count, int level)
+{
+    return kernels().trailingQuiet(ptr, count, level);
+}
+
+PcmIsa pcmIsa()
+{
+    return kernels().isa;
+}
+
+char const* pcmIsaName(PcmIsa isa)
+{
+    switch (isa) {
+    case PcmIsa::SSE2:
+        return "sse2";
+    case PcmIsa::AVX2:
+        return "avx2";
+    default:
+        return "scalar";
+    }
+}
+
+PcmIsa setPcmIsa(PcmIsa isa)
+{
+    auto* k = bestKernels(isa);
+    active.store(k, std::memory_order_release);
+    return k->isa;
+}
+
+} // namespace chipmachine
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+
+namespace chipmachine {
+
+// Vectorized loops over 16 bit PCM, used on every decoded block. The best
+// implementation for the CPU is picked the first time one is called.
+enum class PcmIsa
+{
+    Scalar,
+    SSE2,
+    AVX2
+};
+
+// Multiply interleaved stereo by a gain going linearly from `from` (first
+// frame) towards `to` (frame after the last), saturating to 16 bits
+void pcmGainRamp(int16_t* ptr, int count, float from, float to);
+
+// Number of samples at the end of `ptr` with magnitude below `level`
+int pcmTrailingQuiet(int16_t const* ptr, int count, int level);
+
+// Implementation in use
+PcmIsa pcmIsa();
+char const* pcmIsaName(PcmIsa isa);
+
+// Select an implementation; returns the one actually used, which is lower
+// if the CPU does not support `isa`. For tests and benchmarks.
+PcmIsa setPcmIsa(PcmIsa isa);
+
+} // namespace chipmachine
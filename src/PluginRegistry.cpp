@@ -0,0 +1,187 @@
+#include "PluginRegistry.h"
+
+#include <coreutils/log.h>
+#include <coreutils/utils.h>
+#include <musicplayer/chipplugin.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iterator>
+#include <mutex>
+#include <unordered_map>
+
+namespace chipmachine {
+
+namespace {
+
+// Name parts plugins decide on; empty if the whole name must be checked
+struct DispatchKey
+{
+    std::string prefix;
+    std::string ext;
+    bool valid = false;
+};
+
+DispatchKey dispatchKey(std::string const& lowerName)
+{
+    DispatchKey key;
+    // URLs are claimed on other grounds (youtube for instance)
+    if (lowerName.find("://") != std::string::npos) return key;
+    auto slash = lowerName.find_last_of("/\\");
+    auto base = slash == std::string::npos ? lowerName
+                                           : lowerName.substr(slash + 1);
+    auto first = base.find('.');
+    auto last = base.rfind('.');
+    if (first == std::string::npos) return key;
+    // Longer parts are song names rather than formats, and would fill the
+    // tables with one entry per song
+    static constexpr size_t MaxLength = 6;
+    key.prefix = base.substr(0, first);
+    if (key.prefix.size() > MaxLength) key.prefix = "";
+    key.ext = base.substr(last + 1);
+    if (key.ext.size() > MaxLength) key.ext = "";
+    key.valid = !key.prefix.empty() || !key.ext.empty();
+    return key;
+}
+
+uint32_t readMagic(std::string const& fileName)
+{
+    uint32_t magic = 0;
+    if (FILE* fp = fopen(fileName.c_str(), "rb")) {
+        if (fread(&magic, 1, sizeof(magic), fp) != sizeof(magic)) magic = 0;
+        fclose(fp);
+    }
+    return magic;
+}
+
+struct Registry
+{
+    std::mutex m;
+    // Plugins at the time the tables were built; they are only ever added
+    size_t pluginCount = 0;
+    // Indexes of plugins claiming names with an extension or prefix
+    std::unordered_map<std::string, std::vector<int>> byExt;
+    std::unordered_map<std::string, std::vector<int>> byPrefix;
+    // Plugin that loaded a file, by extension and header
+    std::unordered_map<std::string, int> byMagic;
+    PluginRegistry::Stats stats;
+
+    std::vector<int> const& claims(
+        std::unordered_map<std::string, std::vector<int>>& table,
+        std::string const& part, std::string const& probeName,
+        std::vector<PluginRegistry::PluginPtr> const& plugins)
+    {
+        static std::vector<int> const none;
+        if (part.empty()) return none;
+        auto it = table.find(part);
+        if (it != table.end()) return it->second;
+        auto& result = table[part];
+        for (int i = 0; i < (int)plugins.size(); i++) {
+            if (plugins[i]->canHandle(probeName)) result.push_back(i);
+        }
+        return result;
+    }
+};
+
+Registry& registry()
+{
+    static Registry r;
+    return r;
+}
+
+std::string magicKey(std::string const& ext, uint32_t magic)
+{
+    return ext + ":" + std::to_string(magic);
+}
+
+} // namespace
+
+std::vector<PluginRegistry::PluginPtr>
+PluginRegistry::candidates(std::string const& fileName, bool readHeader)
+{
+    auto name = fileName;
+    utils::makeLower(name);
+    auto const& plugins = musix::ChipPlugin::getPlugins();
+    auto& r = registry();
+    auto start = std::chrono::steady_clock::now();
+    auto key = dispatchKey(name);
+
+    std::vector<PluginPtr> result;
+    bool probed = false;
+    {
+        std::lock_guard lock{ r.m };
+        r.stats.lookups++;
+        if (r.pluginCount != plugins.size()) {
+            r.byExt.clear();
+            r.byPrefix.clear();
+            r.byMagic.clear();
+            r.pluginCount = plugins.size();
+        }
+        if (key.valid) {
+            probed = (!key.ext.empty() && r.byExt.count(key.ext) == 0) ||
+                     (!key.prefix.empty() &&
+                      r.byPrefix.count(key.prefix) == 0);
+            // Names that only have the extension or prefix of the file
+            auto const& ext =
+                r.claims(r.byExt, key.ext, "_probe." + key.ext, plugins);
+            auto const& prefix = r.claims(r.byPrefix, key.prefix,
+                                          key.prefix + "._probe", plugins);
+            std::vector<int> found;
+            std::set_union(ext.begin(), ext.end(), prefix.begin(),
+                           prefix.end(), std::back_inserter(found));
+            // Confirm with the real name, which is cheap for a few plugins
+            for (int i : found) {
+                if (plugins[i]->canHandle(name)) result.push_back(plugins[i]);
+            }
+        }
+    }
+
+    if (result.empty()) {
+        // Claimed for some other reason; ask everyone
+        probed = true;
+        for (auto const& plugin : plugins) {
+            if (plugin->canHandle(name)) result.push_back(plugin);
+        }
+    } else if (result.size() > 1 && readHeader) {
+        auto magic = magicKey(key.ext, readMagic(fileName));
+        std::lock_guard lock{ r.m };
+        auto it = r.byMagic.find(magic);
+        if (it != r.byMagic.end() && it->second < (int)plugins.size()) {
+            auto const& best = plugins[it->second];
+            auto pos = std::find(result.begin(), result.end(), best);
+            if (pos != result.end()) std::rotate(result.begin(), pos, pos + 1);
+        }
+    }
+
+    std::chrono::duration<double> t = std::chrono::steady_clock::now() - start;
+    std::lock_guard lock{ r.m };
+    r.stats.probeSeconds += t.count();
+    if (probed) r.stats.probes++;
+    return result;
+}
+
+void PluginRegistry::loaded(std::string const& fileName,
+                            PluginPtr const& plugin)
+{
+    auto name = fileName;
+    utils::makeLower(name);
+    auto key = dispatchKey(name);
+    if (!key.valid) return;
+    auto magic = magicKey(key.ext, readMagic(fileName));
+    auto const& plugins = musix::ChipPlugin::getPlugins();
+    auto pos = std::find(plugins.begin(), plugins.end(), plugin);
+    if (pos == plugins.end()) return;
+    auto& r = registry();
+    std::lock_guard lock{ r.m };
+    r.byMagic[magic] = (int)(pos - plugins.begin());
+}
+
+PluginRegistry::Stats PluginRegistry::getStats()
+{
+    auto& r = registry();
+    std::lock_guard lock{ r.m };
+    return r.stats;
+}
+
+} // namespace chipmachine
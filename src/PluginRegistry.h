@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace musix {
+class ChipPlugin;
+}
+
+namespace chipmachine {
+
+// Finds the plugins that can play a file. Rather than asking every plugin
+// with canHandle() for every file, plugins are asked once per extension and
+// per modland style prefix ("mdat.", "smpl."), and the answers are kept in
+// hash tables. Which plugin managed to load a file with a given header is
+// remembered, and tried first for files that look the same.
+class PluginRegistry
+{
+public:
+    using PluginPtr = std::shared_ptr<musix::ChipPlugin>;
+
+    // Plugins that claim the file, in the order they should be tried. The
+    // header is read from `fileName` if `readHeader` is set.
+    static std::vector<PluginPtr> candidates(std::string const& fileName,
+                                             bool readHeader = true);
+
+    // `plugin` loaded `fileName`
+    static void loaded(std::string const& fileName, PluginPtr const& plugin);
+
+    struct Stats
+    {
+        uint64_t lookups = 0;
+        // Lookups that had to call canHandle() on all plugins
+        uint64_t probes = 0;
+        double probeSeconds = 0;
+    };
+    static Stats getStats();
+};
+
+} // namespace chipmachine
@@ -0,0 +1,113 @@
+#include "Realtime.h"
+
+#include <coreutils/format.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#    include <pthread.h>
+#    include <sched.h>
+#    include <sys/mman.h>
+#    include <sys/resource.h>
+#    define HAVE_PTHREAD_SCHED 1
+#endif
+
+namespace chipmachine {
+
+std::string Realtime::Result::describe() const
+{
+    std::string s = policy;
+    if (priority > 0) s += utils::format(" %d", priority);
+    if (pinned) s += ", pinned";
+    if (!error.empty()) s += " (" + error + ")";
+    return s;
+}
+
+std::vector<int> Realtime::parseCpus(std::string const& text)
+{
+    std::vector<int> cpus;
+    std::stringstream ss(text);
+    std::string part;
+    while (std::getline(ss, part, ',')) {
+        int first = 0;
+        int last = 0;
+        char dash = 0;
+        std::stringstream ps(part);
+        if (!(ps >> first) || first < 0) continue;
+        last = first;
+        if (ps >> dash && (dash != '-' || !(ps >> last) || last < first)) {
+            continue;
+        }
+        for (int c = first; c <= last; c++)
+            cpus.push_back(c);
+    }
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    return cpus;
+}
+
+Realtime::Result Realtime::applyToThread(Options const& options, int boost)
+{
+    Result result;
+#ifdef HAVE_PTHREAD_SCHED
+    int priority = options.priority + boost;
+#    ifdef RLIMIT_RTPRIO
+    // Unprivileged users may be allowed priorities up to the limit
+    rlimit limit{};
+    if (getrlimit(RLIMIT_RTPRIO, &limit) == 0 && limit.rlim_cur > 0 &&
+        limit.rlim_cur != RLIM_INFINITY && (int)limit.rlim_cur < priority) {
+        priority = (int)limit.rlim_cur;
+    }
+#    endif
+    int err = 0;
+    for (int policy : { SCHED_FIFO, SCHED_RR }) {
+        sched_param param{};
+        param.sched_priority =
+            std::clamp(priority, sched_get_priority_min(policy),
+                       sched_get_priority_max(policy));
+        err = pthread_setschedparam(pthread_self(), policy, &param);
+        if (err == 0) {
+            result.policy = policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_RR";
+            result.priority = param.sched_priority;
+            break;
+        }
+    }
+    if (err != 0) result.error = strerror(err);
+
+#    ifdef __linux__
+    if (!options.cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int c : options.cpus) {
+            if (c < CPU_SETSIZE) CPU_SET(c, &set);
+        }
+        err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err == 0)
+            result.pinned = true;
+        else if (result.error.empty())
+            result.error = utils::format("pinning: %s", strerror(err));
+    }
+#    else
+    if (!options.cpus.empty() && result.error.empty()) {
+        result.error = "pinning not supported";
+    }
+#    endif
+#else
+    result.error = "not supported";
+#endif
+    return result;
+}
+
+bool Realtime::lockMemory(void const* ptr, size_t bytes)
+{
+#ifdef HAVE_PTHREAD_SCHED
+    return mlock(ptr, bytes) == 0;
+#else
+    return false;
+#endif
+}
+
+} // namespace chipmachine
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace chipmachine {
+
+// Opt-in scheduling for the threads that produce audio. Everything is best
+// effort; without privileges threads keep normal scheduling.
+class Realtime
+{
+public:
+    struct Options
+    {
+        bool enabled = false;
+        // SCHED_FIFO priority of the decoder; the audio callback gets one
+        // above it so it always preempts decoding
+        int priority = 10;
+        // Cores for the audio threads; empty means any
+        std::vector<int> cpus;
+    };
+
+    // What a thread ended up with
+    struct Result
+    {
+        std::string policy = "SCHED_OTHER";
+        int priority = 0;
+        bool pinned = false;
+        // Why something could not be applied, empty if all was
+        std::string error;
+
+        [[nodiscard]] std::string describe() const;
+    };
+
+    // "2,3" or "0-1,3"; invalid parts are ignored
+    static std::vector<int> parseCpus(std::string const& text);
+
+    // Apply to the calling thread, with priority `options.priority + boost`
+    static Result applyToThread(Options const& options, int boost);
+
+    // Keep pages in RAM; false if not permitted (see RLIMIT_MEMLOCK)
+    static bool lockMemory(void const* ptr, size_t bytes);
+};
+
+} // namespace chipmachine
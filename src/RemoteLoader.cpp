@@ -3,6 +3,8 @@
 #include <coreutils/log.h>
 #include <coreutils/split.h>
 
+#include <unordered_set>
+
 using namespace std;
 using namespace utils;
 
@@ -61,9 +63,8 @@ bool RemoteLoader::isOffline(const std::string& p)
     return inCache(p) || File::exists(local_path);
 }
 
-bool RemoteLoader::load(const std::string& p, function<void(File f)> done_cb)
+std::pair<string, string> RemoteLoader::locate(const std::string& p)
 {
-
     Source source;
     string path = p;
 
@@ -73,20 +74,18 @@ bool RemoteLoader::load(const std::string& p, function<void(File f)> done_cb)
         path = parts[1];
     }
 
-    string local_path = source.local_dir + path;
-    LOGD("Local path: %s", local_path);
-    if (File::exists(local_path)) {
-        schedule_callback([=]() { done_cb(File(local_path)); });
-        return true;
-    }
-
     string url = source.url + path;
 
     if (url.find("snesmusic.org") != string::npos) {
         url = url.substr(0, url.length() - 4);
     }
+    return { source.local_dir + path, url };
+}
 
-    lastSession = webgetter.getFile(url, [=](webutils::WebJob job) {
+std::shared_ptr<webutils::WebJob>
+RemoteLoader::getFile(const std::string& url, function<void(File f)> done_cb)
+{
+    return webgetter.getFile(url, [=](webutils::WebJob job) {
         LOGD("CODE %d", job.code());
         auto f = job.file();
         string fileName = f.getName();
@@ -97,10 +96,74 @@ bool RemoteLoader::load(const std::string& p, function<void(File f)> done_cb)
         }
         done_cb(f);
     });
+}
+
+bool RemoteLoader::load(const std::string& p, function<void(File f)> done_cb)
+{
+    auto [local_path, url] = locate(p);
+    LOGD("Local path: %s", local_path);
+    if (File::exists(local_path)) {
+        schedule_callback([=]() { done_cb(File(local_path)); });
+        return true;
+    }
+
+    // Downloading the same file twice in parallel breaks the cache
+    auto it = prefetches.find(url);
+    if (it != prefetches.end()) {
+        LOGD("Waiting for prefetch of %s", url);
+        it->second.waiting.push_back(done_cb);
+        return true;
+    }
+
+    lastSession = getFile(url, done_cb);
     return true;
 }
 
-// void RemoteLoader::preCache(const std::string &path) {}
+void RemoteLoader::preCache(const std::string& p, function<void(File)> done_cb)
+{
+    auto [local_path, url] = locate(p);
+    if (File::exists(local_path)) {
+        if (done_cb) schedule_callback([=]() { done_cb(File(local_path)); });
+        return;
+    }
+
+    auto it = prefetches.find(url);
+    if (it != prefetches.end()) {
+        if (done_cb) it->second.waiting.push_back(done_cb);
+        return;
+    }
+
+    // Entry must exist before the job starts, in case it completes at once
+    prefetches[url] = {};
+    auto job = getFile(url, [=](File f) {
+        std::vector<function<void(File)>> waiting;
+        auto pit = prefetches.find(url);
+        if (pit != prefetches.end()) {
+            waiting = std::move(pit->second.waiting);
+            prefetches.erase(pit);
+        }
+        for (auto const& cb : waiting)
+            cb(f);
+        if (done_cb) done_cb(f);
+    });
+    it = prefetches.find(url);
+    if (it != prefetches.end()) it->second.job = job;
+}
+
+void RemoteLoader::cancelPreCache(std::vector<std::string> const& keep)
+{
+    std::unordered_set<string> keepUrls;
+    for (auto const& p : keep)
+        keepUrls.insert(locate(p).second);
+
+    for (auto it = prefetches.begin(); it != prefetches.end();) {
+        if (it->second.waiting.empty() && keepUrls.count(it->first) == 0) {
+            if (it->second.job) it->second.job->stop();
+            it = prefetches.erase(it);
+        } else
+            ++it;
+    }
+}
 
 std::shared_ptr<webutils::WebJob> RemoteLoader::stream(
     const std::string& p,
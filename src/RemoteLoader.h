@@ -7,6 +7,8 @@
 #include <functional>
 #include <string>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 class RemoteLoader
 {
@@ -23,7 +25,14 @@ public:
         const std::string& path,
         std::function<bool(int what, const uint8_t* data, int size)> data_cb);
 
-    void preCache(const std::string& path);
+    // Fetch a file into the cache in the background; `done_cb` (if set) gets
+    // the file. A load() of the same file waits for the prefetch instead of
+    // downloading it again.
+    void preCache(const std::string& path,
+                  std::function<void(utils::File)> done_cb = nullptr);
+
+    // Stop prefetches that no load() is waiting for, except those in `keep`
+    void cancelPreCache(std::vector<std::string> const& keep = {});
 
     bool inCache(const std::string& path) const;
 
@@ -52,7 +61,20 @@ private:
         std::string local_dir;
     };
 
+    struct Prefetch
+    {
+        std::shared_ptr<webutils::WebJob> job;
+        std::vector<std::function<void(utils::File)>> waiting;
+    };
+
+    // Local path and URL of a `source::path`
+    std::pair<std::string, std::string> locate(const std::string& p);
+    std::shared_ptr<webutils::WebJob>
+    getFile(const std::string& url, std::function<void(utils::File)> done_cb);
+
     std::unordered_map<std::string, Source> sources;
+    // Prefetches in progress, by URL
+    std::unordered_map<std::string, Prefetch> prefetches;
 
     webutils::Web webgetter;
     std::shared_ptr<webutils::WebJob> lastSession;
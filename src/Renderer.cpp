@@ -0,0 +1,313 @@
+#include "Renderer.h"
+#include "GZPlugin.h"
+#include "PcmKernels.h"
+#include "PluginRegistry.h"
+#include "Resampler.h"
+
+#include <coreutils/format.h>
+#include <coreutils/log.h>
+#include <coreutils/utils.h>
+#include <musicplayer/chipplayer.h>
+#include <musicplayer/chipplugin.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+
+namespace chipmachine {
+
+static constexpr int PluginHz = 44100;
+
+// Writes 16 bit stereo, with a WAV header unless `raw`
+class PcmWriter
+{
+public:
+    PcmWriter(std::string const& name, int hz, bool raw)
+        : out(name, std::ios::binary), raw(raw)
+    {
+        if (!raw) writeHeader(hz, 0);
+    }
+
+    ~PcmWriter()
+    {
+        if (!raw && out) {
+            out.seekp(0);
+            writeHeader(hz, bytes);
+        }
+    }
+
+    explicit operator bool() const { return (bool)out; }
+
+    void write(int16_t const* ptr, int count)
+    {
+        // WAV is little endian, as are all our targets
+        out.write((char const*)ptr, count * 2);
+        bytes += count * 2;
+    }
+
+private:
+    template <typename T> void put(T v)
+    {
+        out.write((char const*)&v, sizeof(T));
+    }
+
+    void writeHeader(int rate, uint32_t dataBytes)
+    {
+        hz = rate;
+        out.write("RIFF", 4);
+        put<uint32_t>(36 + dataBytes);
+        out.write("WAVEfmt ", 8);
+        put<uint32_t>(16);
+        put<uint16_t>(1); // PCM
+        put<uint16_t>(2);
+        put<uint32_t>(rate);
+        put<uint32_t>(rate * 4);
+        put<uint16_t>(4);
+        put<uint16_t>(16);
+        out.write("data", 4);
+        put<uint32_t>(dataBytes);
+    }
+
+    std::ofstream out;
+    bool raw;
+    int hz = 0;
+    uint32_t bytes = 0;
+};
+
+static std::shared_ptr<musix::ChipPlugin> findPlugin(std::string const& file)
+{
+    auto plugins = PluginRegistry::candidates(file);
+    return plugins.empty() ? nullptr : plugins[0];
+}
+
+// Many emulators keep their state in globals shared by all players, so two
+// songs playing at once corrupt each other even if no two calls overlap.
+// Only plugins known to keep everything in the player run in parallel; the
+// others hold this lock from loading a song until its player is gone.
+static std::mutex exclusiveMutex;
+
+static std::unique_lock<std::mutex> lockPlugin(musix::ChipPlugin& plugin)
+{
+    static std::set<std::string> const reentrant = { "GME", "OpenMPT" };
+    std::unique_lock lock{ exclusiveMutex, std::defer_lock };
+    if (reentrant.count(plugin.name()) == 0) lock.lock();
+    return lock;
+}
+
+std::string Renderer::outputName(std::string const& file, int tune) const
+{
+    auto name = std::filesystem::path(file).filename().string();
+    if (tune >= 0) name += utils::format("_%02d", tune);
+    name += options.raw ? ".raw" : ".wav";
+    return (std::filesystem::path(options.outDir) / name).string();
+}
+
+// Same threshold as playback uses
+static constexpr int SilenceLevel = 16;
+
+bool Renderer::analyze(std::string const& file, int tune, Analysis& result,
+                       int maxSeconds, int silenceSeconds)
+{
+    auto plugin = findPlugin(file);
+    if (!plugin) return false;
+    auto lock = lockPlugin(*plugin);
+    std::unique_ptr<musix::ChipPlayer> player{ plugin->fromFile(file) };
+    if (!player) return false;
+
+    int startTune = std::max(player->getMetaInt("startSong"), 0);
+    if (tune < 0)
+        tune = startTune;
+    else if (tune != startTune)
+        player->seekTo(tune, -1);
+    result.file = file;
+    result.tune = tune;
+    result.tunes = std::max(player->getMetaInt("songs"), 1);
+
+    std::vector<int16_t> buf(8192);
+    int64_t frame = 0;
+    int64_t lastSound = 0;
+    bool sound = false;
+    int64_t maxFrames = (int64_t)maxSeconds * PluginHz;
+    int64_t silenceFrames = (int64_t)silenceSeconds * PluginHz;
+    bool looped = true;
+    while (frame < maxFrames) {
+        int n = player->getSamples(buf.data(), buf.size());
+        if (n <= 0) {
+            looped = false;
+            break;
+        }
+        int loud = n - pcmTrailingQuiet(buf.data(), n, SilenceLevel);
+        if (loud > 0) {
+            lastSound = frame + (loud - 1) / 2;
+            sound = true;
+        }
+        frame += n / 2;
+        if (frame - lastSound > silenceFrames) {
+            looped = false;
+            break;
+        }
+    }
+    if (!sound)
+        result.lengthMs = Analysis::Silent;
+    else
+        result.lengthMs = looped ? 0 : (int)(lastSound * 1000 / PluginHz);
+    return true;
+}
+
+std::vector<Renderer::Result>
+Renderer::analyzeFile(std::string const& file, std::vector<Analysis>& out) const
+{
+    std::vector<Result> results;
+    int tune = options.allTunes ? std::max(options.tune, 0) : options.tune;
+    int lastTune = tune;
+    do {
+        Result result;
+        auto plugin = findPlugin(file);
+        if (plugin) result.plugin = plugin->name();
+        auto start = std::chrono::steady_clock::now();
+        Analysis a;
+        result.ok = analyze(file, tune, a, options.seconds);
+        std::chrono::duration<double> t =
+            std::chrono::steady_clock::now() - start;
+        result.cpuSeconds = t.count();
+        results.push_back(result);
+        if (!result.ok) break;
+        out.push_back(a);
+        results.back().audioSeconds =
+            a.lengthMs > 0 ? a.lengthMs / 1000.0 : options.seconds;
+        if (options.allTunes) lastTune = a.tunes - 1;
+    } while (++tune <= lastTune);
+    return results;
+}
+
+std::vector<Renderer::Result>
+Renderer::renderFile(std::string const& file) const
+{
+    std::vector<Result> results;
+    auto plugin = findPlugin(file);
+    if (!plugin) {
+        LOGE("No plugin for %s", file);
+        results.emplace_back();
+        return results;
+    }
+
+    auto lock = lockPlugin(*plugin);
+    std::vector<int16_t> buf(8192);
+    std::vector<int16_t> resampled;
+    Resampler resampler;
+    resampler.setup(PluginHz, options.hz, Resampler::Best);
+
+    int tune = options.tune;
+    int lastTune = tune;
+    while (true) {
+        Result result;
+        result.plugin = plugin->name();
+        auto start = std::chrono::steady_clock::now();
+
+        std::unique_ptr<musix::ChipPlayer> player{ plugin->fromFile(file) };
+        if (!player) {
+            LOGE("%s could not load %s", result.plugin, file);
+            results.push_back(result);
+            break;
+        }
+        if (options.allTunes && tune < 0) {
+            tune = 0;
+            lastTune = std::max(player->getMetaInt("songs"), 1) - 1;
+        }
+        if (tune >= 0) player->seekTo(tune, -1);
+
+        int seconds = player->getMetaInt("length");
+        if (seconds <= 0) seconds = options.seconds;
+        int64_t left = (int64_t)seconds * PluginHz * 2;
+
+        auto outName = outputName(file, options.allTunes ? tune : -1);
+        PcmWriter writer{ outName, options.hz, options.raw };
+        if (!writer) {
+            LOGE("Could not write %s", outName);
+            results.push_back(result);
+            break;
+        }
+        resampler.reset();
+        while (left > 0) {
+            auto count = std::min<int64_t>(left, buf.size());
+            int n = player->getSamples(buf.data(), (int)count);
+            if (n <= 0) break;
+            left -= n;
+            result.audioSeconds += n / 2.0 / PluginHz;
+            if (resampler.active()) {
+                resampled.clear();
+                resampler.process(buf.data(), n, resampled);
+                writer.write(resampled.data(), resampled.size());
+            } else
+                writer.write(buf.data(), n);
+        }
+
+        std::chrono::duration<double> t =
+            std::chrono::steady_clock::now() - start;
+        result.cpuSeconds = t.count();
+        result.ok = true;
+        results.push_back(result);
+
+        if (!options.allTunes || ++tune > lastTune) break;
+    }
+    return results;
+}
+
+bool Renderer::render(std::vector<std::string> const& files)
+{
+    static std::once_flag gzAdded;
+    std::call_once(gzAdded, [] {
+        musix::ChipPlugin::addPlugin(std::make_shared<GZPlugin>(), true);
+    });
+
+    int jobs = options.jobs > 0 ? options.jobs
+                                : (int)std::thread::hardware_concurrency();
+    jobs = std::clamp(jobs, 1, std::max((int)files.size(), 1));
+
+    std::atomic<size_t> next{ 0 };
+    std::mutex statsMutex;
+    stats.clear();
+    analyses.clear();
+
+    auto worker = [&] {
+        while (true) {
+            auto i = next++;
+            if (i >= files.size()) break;
+            std::vector<Analysis> found;
+            auto results = options.analyze ? analyzeFile(files[i], found)
+                                           : renderFile(files[i]);
+            std::lock_guard lock{ statsMutex };
+            analyses.insert(analyses.end(), found.begin(), found.end());
+            for (auto const& r : results) {
+                auto& s = stats[r.plugin.empty() ? "none" : r.plugin];
+                if (!r.ok) {
+                    s.failed++;
+                    continue;
+                }
+                s.songs++;
+                s.audioSeconds += r.audioSeconds;
+                s.cpuSeconds += r.cpuSeconds;
+                LOGI("%s: %.1fs in %.2fs", files[i], r.audioSeconds,
+                     r.cpuSeconds);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < jobs; i++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads)
+        t.join();
+
+    return std::none_of(stats.begin(), stats.end(),
+                        [](auto const& s) { return s.second.failed > 0; });
+}
+
+} // namespace chipmachine
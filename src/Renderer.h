@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace chipmachine {
+
+// Renders songs straight from the plugins to WAV or raw PCM files, as fast
+// as the CPU allows and with no audio device involved.
+class Renderer
+{
+public:
+    struct Options
+    {
+        std::string outDir = ".";
+        // Subsong to render, -1 for the default one
+        int tune = -1;
+        bool allTunes = false;
+        // Used when the plugin does not know the length
+        int seconds = 180;
+        int hz = 44100;
+        bool raw = false;
+        // Files rendered in parallel; 0 means one per core
+        int jobs = 0;
+        // Find song lengths instead of writing files
+        bool analyze = false;
+    };
+
+    struct Analysis
+    {
+        std::string file;
+        int tune = 0;
+        int tunes = 0;
+        // Where the sound ends, 0 if it never did (looping songs) and
+        // Silent if there was no sound at all (unused subsongs)
+        int lengthMs = 0;
+        static constexpr int Silent = -1;
+    };
+
+    struct Stats
+    {
+        int songs = 0;
+        int failed = 0;
+        double audioSeconds = 0;
+        double cpuSeconds = 0;
+        // Seconds of audio per second of rendering
+        [[nodiscard]] double realtimeFactor() const
+        {
+            return cpuSeconds > 0 ? audioSeconds / cpuSeconds : 0;
+        }
+    };
+
+    explicit Renderer(Options const& options) : options(options) {}
+
+    // Render all files; returns false if any failed
+    bool render(std::vector<std::string> const& files);
+
+    // Render a subsong (-1 for the default one) without output, until
+    // `maxSeconds` or until it has been silent for `silenceSeconds`.
+    // Returns false if the file could not be played.
+    static bool analyze(std::string const& file, int tune, Analysis& result,
+                        int maxSeconds = 600, int silenceSeconds = 6);
+
+    // Results when rendering with `analyze` set
+    [[nodiscard]] std::vector<Analysis> const& getAnalyses() const
+    {
+        return analyses;
+    }
+
+    // Per plugin statistics, after render()
+    [[nodiscard]] std::map<std::string, Stats> const& getStats() const
+    {
+        return stats;
+    }
+
+private:
+    struct Result
+    {
+        std::string plugin;
+        bool ok = false;
+        double audioSeconds = 0;
+        double cpuSeconds = 0;
+    };
+
+    std::vector<Result> renderFile(std::string const& file) const;
+    [[nodiscard]] std::string outputName(std::string const& file,
+                                         int tune) const;
+
+    std::vector<Result> analyzeFile(std::string const& file,
+                                    std::vector<Analysis>& out) const;
+
+    Options options;
+    std::map<std::string, Stats> stats;
+    std::vector<Analysis> analyses;
+};
+
+} // namespace chipmachine
@@ -0,0 +1,153 @@
+#include "Resampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#    define RESAMPLER_HAVE_AVX 1
+#    include <immintrin.h>
+#elif defined(__SSE__)
+#    include <xmmintrin.h>
+#endif
+
+namespace chipmachine {
+
+static constexpr double PI = 3.14159265358979323846;
+
+static float dotSSE(float const* a, float const* b, int n)
+{
+    int i = 0;
+    float sum = 0;
+#ifdef __SSE__
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4)
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i),
+                                         _mm_loadu_ps(b + i)));
+    float t[4];
+    _mm_storeu_ps(t, acc);
+    sum = (t[0] + t[1]) + (t[2] + t[3]);
+#endif
+    for (; i < n; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+#ifdef RESAMPLER_HAVE_AVX
+__attribute__((target("avx"))) static float dotAVX(float const* a,
+                                                   float const* b, int n)
+{
+    int i = 0;
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8)
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(a + i),
+                                               _mm256_loadu_ps(b + i)));
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(acc),
+                             _mm256_extractf128_ps(acc, 1));
+    float t[4];
+    _mm_storeu_ps(t, half);
+    float sum = (t[0] + t[1]) + (t[2] + t[3]);
+    for (; i < n; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+#endif
+
+// Picked once at startup, like the PCM kernels
+static float (*const dot)(float const*, float const*, int) = [] {
+#ifdef RESAMPLER_HAVE_AVX
+    if (__builtin_cpu_supports("avx")) return dotAVX;
+#endif
+    return dotSSE;
+}();
+
+static int16_t clip(float v)
+{
+    return (int16_t)std::clamp(std::lround(v), -32768L, 32767L);
+}
+
+Resampler::Quality Resampler::qualityFromName(std::string const& name)
+{
+    if (name == "fast") return Fast;
+    if (name == "best") return Best;
+    return Medium;
+}
+
+void Resampler::setup(int in, int out, Quality quality)
+{
+    inHz = in;
+    outHz = out;
+    step = (double)inHz / outHz;
+
+    taps = quality == Fast ? 2 : quality == Medium ? 16 : 48;
+    // Fast needs the phases too; with one, the weights are only ever 0 or
+    // 1, which is nearest neighbour rather than linear
+    phases = 256;
+    int half = taps / 2;
+    // Lower the cutoff when downsampling to avoid aliasing
+    double cutoff = std::min(1.0, (double)outHz / inHz) * 0.95;
+
+    kernel.assign((phases + 1) * taps, 0.0F);
+    for (int p = 0; p <= phases; p++) {
+        double frac = (double)p / phases;
+        float* row = &kernel[p * taps];
+        double sum = 0;
+        for (int k = 0; k < taps; k++) {
+            // Distance from output position to input sample
+            double x = (k - half + 1) - frac;
+            double w = 0;
+            if (quality == Fast) {
+                w = std::max(0.0, 1.0 - std::abs(x));
+            } else {
+                double s = x == 0 ? 1.0 : std::sin(PI * x * cutoff) /
+                                              (PI * x * cutoff);
+                // Blackman window over the kernel
+                double n = (x + half) / taps;
+                double win = 0.42 - 0.5 * std::cos(2 * PI * n) +
+                             0.08 * std::cos(4 * PI * n);
+                w = s * std::max(win, 0.0);
+            }
+            row[k] = (float)w;
+            sum += w;
+        }
+        // Unity gain at DC
+        for (int k = 0; k < taps; k++)
+            row[k] = (float)(row[k] / sum);
+    }
+    reset();
+}
+
+void Resampler::reset()
+{
+    // Pad so the first output frame has history to the left
+    left.assign(taps / 2 - 1, 0.0F);
+    right.assign(taps / 2 - 1, 0.0F);
+    pos = taps / 2 - 1;
+}
+
+void Resampler::process(int16_t const* in, int count, std::vector<int16_t>& out)
+{
+    for (int i = 0; i + 1 < count; i += 2) {
+        left.push_back(in[i]);
+        right.push_back(in[i + 1]);
+    }
+
+    int half = taps / 2;
+    auto size = (int64_t)left.size();
+    while ((int64_t)pos + half < size) {
+        auto ip = (int64_t)pos;
+        auto phase = (int)std::lround((pos - ip) * phases);
+        float const* k = &kernel[phase * taps];
+        auto start = ip - half + 1;
+        out.push_back(clip(dot(&left[start], k, taps)));
+        out.push_back(clip(dot(&right[start], k, taps)));
+        pos += step;
+    }
+
+    // Keep only what the next output frame needs
+    auto drop = std::clamp<int64_t>((int64_t)pos - half + 1, 0, size);
+    left.erase(left.begin(), left.begin() + drop);
+    right.erase(right.begin(), right.begin() + drop);
+    pos -= drop;
+}
+
+} // namespace chipmachine
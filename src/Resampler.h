@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace chipmachine {
+
+// Converts interleaved 16 bit stereo between sample rates using a windowed
+// sinc kernel, stored as a polyphase table.
+class Resampler
+{
+public:
+    enum Quality
+    {
+        // Linear interpolation; for slow machines
+        Fast,
+        // 16 tap sinc
+        Medium,
+        // 48 tap sinc
+        Best
+    };
+
+    // "fast", "medium" or "best"; defaults to Medium
+    static Quality qualityFromName(std::string const& name);
+
+    void setup(int inHz, int outHz, Quality quality);
+
+    // True if rates differ so process() must be called
+    [[nodiscard]] bool active() const { return inHz != outHz; }
+
+    // Convert `count` samples and append the result to `out`. Output lags
+    // input by half the kernel length.
+    void process(int16_t const* in, int count, std::vector<int16_t>& out);
+
+    // Drop buffered input, for instance after a seek
+    void reset();
+
+private:
+    int inHz = 44100;
+    int outHz = 44100;
+    int taps = 2;
+    int phases = 1;
+    // `phases + 1` rows of `taps` weights
+    std::vector<float> kernel;
+
+    // Pending input, one channel each
+    std::vector<float> left;
+    std::vector<float> right;
+    // Position of next output frame, in input frames from start of `left`
+    double pos = 0;
+    double step = 1.0;
+};
+
+} // namespace chipmachine
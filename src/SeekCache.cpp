@@ -0,0 +1,124 @@
+#include "SeekCache.h"
+
+#include <coreutils/log.h>
+
+#include <algorithm>
+#include <cstring>
+#include <zlib.h>
+
+namespace chipmachine {
+
+void SeekCache::reset(int64_t frame)
+{
+    blocks.clear();
+    pending.clear();
+    base = frame;
+    frames = 0;
+    bytes = 0;
+    decodedIndex = SIZE_MAX;
+}
+
+void SeekCache::append(int64_t frame, int16_t const* samples, int count)
+{
+    if (frame != end()) return;
+    while (count > 0) {
+        int n = std::min<int>(count, BlockFrames * 2 - (int)pending.size());
+        pending.insert(pending.end(), samples, samples + n);
+        samples += n;
+        count -= n;
+        frames += n / 2;
+        if ((int)pending.size() == BlockFrames * 2) compress();
+    }
+}
+
+bool SeekCache::pack(int16_t const* samples, size_t count,
+                     std::vector<uint8_t>& out)
+{
+    // Deltas between frames compress much better than the samples
+    std::vector<int16_t> delta(count);
+    int16_t last[2] = { 0, 0 };
+    for (size_t i = 0; i < count; i++) {
+        delta[i] = (int16_t)(samples[i] - last[i & 1]);
+        last[i & 1] = samples[i];
+    }
+
+    auto srcSize = (uLong)(count * 2);
+    auto size = compressBound(srcSize);
+    out.resize(size);
+    if (compress2(out.data(), &size, (Bytef const*)delta.data(), srcSize,
+                  Z_BEST_SPEED) != Z_OK)
+        return false;
+    out.resize(size);
+    return true;
+}
+
+// `out` must be sized to the number of samples expected
+bool SeekCache::unpack(uint8_t const* data, size_t size,
+                       std::vector<int16_t>& out)
+{
+    auto outSize = (uLongf)(out.size() * 2);
+    if (uncompress((Bytef*)out.data(), &outSize, data, size) != Z_OK ||
+        outSize != out.size() * 2)
+        return false;
+    int16_t last[2] = { 0, 0 };
+    for (size_t i = 0; i < out.size(); i++) {
+        out[i] = (int16_t)(out[i] + last[i & 1]);
+        last[i & 1] = out[i];
+    }
+    return true;
+}
+
+void SeekCache::compress()
+{
+    std::vector<uint8_t> block;
+    if (!pack(pending.data(), pending.size(), block)) {
+        LOGE("Could not compress seek cache block");
+        reset(end());
+        return;
+    }
+    block.shrink_to_fit();
+    bytes += block.size();
+    blocks.push_back(std::move(block));
+    pending.clear();
+
+    if (bytes > maxBytes) {
+        LOGD("Seek cache full at frame %d, starting over", (int)end());
+        reset(end());
+    }
+}
+
+void SeekCache::decompress(size_t index)
+{
+    if (index == decodedIndex) return;
+    decoded.resize(BlockFrames * 2);
+    auto const& block = blocks[index];
+    if (!unpack(block.data(), block.size(), decoded)) {
+        LOGE("Could not uncompress seek cache block");
+        std::fill(decoded.begin(), decoded.end(), 0);
+    }
+    decodedIndex = index;
+}
+
+int SeekCache::read(int64_t frame, int16_t* out, int count)
+{
+    if (frame < begin() || frame >= end()) return 0;
+    auto offset = frame - base;
+    auto index = (size_t)(offset / BlockFrames);
+    auto pos = (size_t)(offset % BlockFrames) * 2;
+
+    int16_t const* src = nullptr;
+    size_t avail = 0;
+    if (index < blocks.size()) {
+        decompress(index);
+        src = decoded.data();
+        avail = decoded.size();
+    } else {
+        src = pending.data();
+        avail = pending.size();
+    }
+    int n = (int)std::min<size_t>(count & ~1, avail - pos);
+    memcpy(out, src + pos, n * 2);
+    return n;
+}
+
+} // namespace chipmachine
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace chipmachine {
+
+// Keeps the audio a player has decoded, so seeking back into it does not
+// have to go through the plugin (which for most emulated formats means
+// playing the song again from the start). Audio is stored delta coded and
+// zlib compressed in one second blocks.
+class SeekCache
+{
+public:
+    // 16 bit stereo frames per block
+    static constexpr int BlockFrames = 44100;
+
+    explicit SeekCache(size_t maxBytes = 32 * 1024 * 1024)
+        : maxBytes(maxBytes)
+    {}
+
+    // Forget everything; audio appended next starts at `frame`
+    void reset(int64_t frame = 0);
+
+    // Add `count` samples decoded at `frame`. Ignored unless it continues
+    // what is already cached. Starts over when the cache is full.
+    void append(int64_t frame, int16_t const* samples, int count);
+
+    // Frames that can be read back are [begin(), end())
+    [[nodiscard]] int64_t begin() const { return base; }
+    [[nodiscard]] int64_t end() const { return base + frames; }
+
+    // Read up to `count` samples from `frame`; returns samples read, which
+    // is less than asked for at block boundaries and at end()
+    int read(int64_t frame, int16_t* out, int count);
+
+    [[nodiscard]] size_t compressedSize() const { return bytes; }
+
+    // Block coding, shared with PcmCache
+    static bool pack(int16_t const* samples, size_t count,
+                     std::vector<uint8_t>& out);
+    static bool unpack(uint8_t const* data, size_t size,
+                       std::vector<int16_t>& out);
+
+private:
+    void compress();
+    void decompress(size_t index);
+
+    std::vector<std::vector<uint8_t>> blocks;
+    // Last block, not yet compressed
+    std::vector<int16_t> pending;
+    int64_t base = 0;
+    int64_t frames = 0;
+    size_t bytes = 0;
+    size_t maxBytes;
+
+    // Reads are mostly sequential, so keep the last block unpacked
+    size_t decodedIndex = SIZE_MAX;
+    std::vector<int16_t> decoded;
+};
+
+} // namespace chipmachine
@@ -1,8 +1,8 @@
 #include "SongFileIdentifier.h"
+#include "MemFile.h"
 #include "modutils.h"
 
 #include <archive/archive.h>
-#include <coreutils/environment.h>
 #include <coreutils/file.h>
 #include <coreutils/log.h>
 #include <coreutils/split.h>
@@ -167,8 +167,9 @@ bool parseSnes(SongInfo& info)
 
     info.format = "Super Nintendo";
 
-    utils::path outDir = Environment::getCacheDir() / ".rsntemp";
-    auto* a = utils::Archive::open(info.path, outDir.string(),
+    // Unpacked to memory, only to read the header
+    chipmachine::MemFile outDir;
+    auto* a = utils::Archive::open(info.path, outDir.dir().string(),
                                    utils::Archive::TYPE_RAR);
     // LOGD("ARCHIVE %p", a);
     bool done = false;
@@ -177,7 +178,7 @@ bool parseSnes(SongInfo& info)
         if (done) continue;
         if (utils::path_extension(s) == "spc") {
             a->extract(s);
-            File f{ outDir / s };
+            File f{ outDir.dir() / s };
             f.read(&buffer[0], buffer.size());
             if (buffer[0x23] == 0x1a) {
                 // auto title = std::string((const char*)&buffer[0x2e], 0x20);
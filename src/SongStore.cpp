@@ -0,0 +1,232 @@
+#include "SongStore.h"
+
+#include <algorithm>
+#include <cctype>
+#include <numeric>
+
+namespace chipmachine {
+
+// FNV-1a; must be stable since the hashes are stored on disk
+static uint64_t pathHash(std::string_view s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (char c : s) {
+        h ^= (uint8_t)c;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+template <typename T>
+static void readVector(std::vector<T>& v, apone::File& f)
+{
+    auto sz = f.read<uint32_t>();
+    v.resize(sz);
+    if (sz > 0) f.read((uint8_t*)&v[0], v.size() * sizeof(T));
+}
+
+template <typename T>
+static void writeVector(std::vector<T> const& v, apone::File& f)
+{
+    f.write<uint32_t>(v.size());
+    if (!v.empty()) f.write((uint8_t*)&v[0], v.size() * sizeof(T));
+}
+
+uint32_t StringPool::add(std::string_view s, bool intern)
+{
+    if (intern) {
+        auto it = ids.find(std::string(s));
+        if (it != ids.end()) return it->second;
+    }
+    uint32_t id = size();
+    data.insert(data.end(), s.begin(), s.end());
+    offsets.push_back(data.size());
+    if (intern) ids[std::string(s)] = id;
+    return id;
+}
+
+int64_t StringPool::find(std::string_view s) const
+{
+    if (!ids.empty()) {
+        auto it = ids.find(std::string(s));
+        return it != ids.end() ? it->second : -1;
+    }
+    auto it = std::lower_bound(
+        sorted.begin(), sorted.end(), s,
+        [&](uint32_t id, std::string_view v) { return get(id) < v; });
+    if (it != sorted.end() && get(*it) == s) return *it;
+    return -1;
+}
+
+void StringPool::finish()
+{
+    ids = {};
+    sorted.resize(size());
+    std::iota(sorted.begin(), sorted.end(), 0);
+    std::sort(sorted.begin(), sorted.end(),
+              [&](uint32_t a, uint32_t b) { return get(a) < get(b); });
+}
+
+std::vector<bool> StringPool::match(std::string_view needle) const
+{
+    auto equal = [](char a, char b) { return tolower(a) == tolower(b); };
+    std::vector<bool> result(size());
+    for (uint32_t i = 0; i < size(); i++) {
+        auto s = get(i);
+        result[i] = std::search(s.begin(), s.end(), needle.begin(),
+                                needle.end(), equal) != s.end();
+    }
+    return result;
+}
+
+void StringPool::clear()
+{
+    data.clear();
+    offsets = { 0 };
+    ids.clear();
+    sorted.clear();
+}
+
+void StringPool::dump(apone::File& f) const
+{
+    writeVector(data, f);
+    writeVector(offsets, f);
+}
+
+void StringPool::load(apone::File& f)
+{
+    readVector(data, f);
+    readVector(offsets, f);
+    if (offsets.empty()) offsets = { 0 };
+    ids.clear();
+    sorted.clear();
+}
+
+void SongStore::reserve(size_t n)
+{
+    game.reserve(n);
+    title.reserve(n);
+    composer.reserve(n);
+    format.reserve(n);
+    collection.reserve(n);
+    flags.reserve(n);
+    screenshot.reserve(n);
+}
+
+void SongStore::clear()
+{
+    paths.clear();
+    titles.clear();
+    strings.clear();
+    game.clear();
+    title.clear();
+    composer.clear();
+    format.clear();
+    collection.clear();
+    flags.clear();
+    productStart.clear();
+    productSongs.clear();
+    shots.clear();
+    shots.add("", false);
+    screenshot.clear();
+    pathHashes.clear();
+    pathIndexes.clear();
+}
+
+void SongStore::add(std::string_view path, std::string_view g,
+                    std::string_view t, std::string_view c,
+                    std::string_view fmt, int coll, bool hasMetadata)
+{
+    paths.add(path, false);
+    title.push_back(titles.add(t, false));
+    game.push_back(strings.add(g));
+    composer.push_back(strings.add(c));
+    format.push_back(strings.add(fmt));
+    collection.push_back(coll);
+    flags.push_back(hasMetadata ? HAS_METADATA : 0);
+    screenshot.push_back(0);
+}
+
+void SongStore::addProductSong(uint32_t product, uint32_t songRow)
+{
+    while (productStart.size() <= product + 1)
+        productStart.push_back(productSongs.size());
+    productSongs.push_back(songRow - 1);
+    productStart.back() = productSongs.size();
+}
+
+void SongStore::finish()
+{
+    strings.finish();
+
+    std::vector<uint64_t> hashes(size());
+    for (uint32_t i = 0; i < size(); i++)
+        hashes[i] = pathHash(paths.get(i));
+
+    pathIndexes.resize(size());
+    std::iota(pathIndexes.begin(), pathIndexes.end(), 0);
+    std::sort(pathIndexes.begin(), pathIndexes.end(),
+              [&](uint32_t a, uint32_t b) { return hashes[a] < hashes[b]; });
+    pathHashes.resize(size());
+    for (uint32_t i = 0; i < size(); i++)
+        pathHashes[i] = hashes[pathIndexes[i]];
+}
+
+int64_t SongStore::findPath(std::string_view path) const
+{
+    auto h = pathHash(path);
+    auto it = std::lower_bound(pathHashes.begin(), pathHashes.end(), h);
+    for (; it != pathHashes.end() && *it == h; ++it) {
+        auto index = pathIndexes[it - pathHashes.begin()];
+        if (paths.get(index) == path) return index;
+    }
+    return -1;
+}
+
+void SongStore::dump(apone::File& f, uint16_t version) const
+{
+    f.write<uint16_t>(0xFEDC);
+    f.write<uint16_t>(FILE_FORMAT);
+    f.write<uint16_t>(version);
+    paths.dump(f);
+    titles.dump(f);
+    strings.dump(f);
+    writeVector(game, f);
+    writeVector(title, f);
+    writeVector(composer, f);
+    writeVector(format, f);
+    writeVector(collection, f);
+    writeVector(flags, f);
+    writeVector(productStart, f);
+    writeVector(productSongs, f);
+    shots.dump(f);
+    writeVector(screenshot, f);
+    writeVector(pathHashes, f);
+    writeVector(pathIndexes, f);
+}
+
+bool SongStore::load(apone::File& f, uint16_t version)
+{
+    if (f.read<uint16_t>() != 0xFEDC || f.read<uint16_t>() != FILE_FORMAT ||
+        f.read<uint16_t>() != version)
+        return false;
+    paths.load(f);
+    titles.load(f);
+    strings.load(f);
+    strings.finish();
+    readVector(game, f);
+    readVector(title, f);
+    readVector(composer, f);
+    readVector(format, f);
+    readVector(collection, f);
+    readVector(flags, f);
+    readVector(productStart, f);
+    readVector(productSongs, f);
+    shots.load(f);
+    readVector(screenshot, f);
+    readVector(pathHashes, f);
+    readVector(pathIndexes, f);
+    return true;
+}
+
+} // namespace chipmachine
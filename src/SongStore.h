@@ -0,0 +1,176 @@
+#ifndef SONG_STORE_H
+#define SONG_STORE_H
+
+#include <coreutils/file.h>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace chipmachine {
+
+// Packed, append only string storage. Strings are referenced by id.
+class StringPool
+{
+public:
+    // Add a string and return its id. If `intern` is set, identical strings
+    // share the same id.
+    uint32_t add(std::string_view s, bool intern = true);
+
+    [[nodiscard]] std::string_view get(uint32_t id) const
+    {
+        return { &data[offsets[id]], offsets[id + 1] - offsets[id] };
+    }
+
+    // Id of an interned string, -1 if not present
+    [[nodiscard]] int64_t find(std::string_view s) const;
+
+    // Flag every string containing `needle`, ignoring case
+    [[nodiscard]] std::vector<bool> match(std::string_view needle) const;
+
+    [[nodiscard]] size_t size() const { return offsets.size() - 1; }
+
+    // Replace the interning map with the much smaller sorted index once the
+    // pool is complete; also needed after load()
+    void finish();
+
+    void clear();
+
+    void dump(apone::File& f) const;
+    void load(apone::File& f);
+
+private:
+    std::vector<char> data;
+    std::vector<uint32_t> offsets{ 0 };
+    std::unordered_map<std::string, uint32_t> ids;
+    // Ids ordered by string, for find() after finish()
+    std::vector<uint32_t> sorted;
+};
+
+// Resident, columnar copy of the song table, indexed by ROWID - 1 (which is
+// the same as the search index). Also holds the product -> song mapping.
+class SongStore
+{
+public:
+    struct Song
+    {
+        std::string_view path;
+        std::string_view game;
+        std::string_view title;
+        std::string_view composer;
+        std::string_view format;
+        int collection;
+        bool hasMetadata;
+    };
+
+    SongStore() { clear(); }
+
+    void reserve(size_t n);
+    void clear();
+
+    // Songs must be added in ROWID order
+    void add(std::string_view path, std::string_view game,
+             std::string_view title, std::string_view composer,
+             std::string_view format, int collection, bool hasMetadata);
+
+    // Product -> song pairs must be added in product ROWID order
+    void addProductSong(uint32_t product, uint32_t songRow);
+
+    void finish();
+
+    [[nodiscard]] size_t size() const { return collection.size(); }
+
+    [[nodiscard]] Song get(uint32_t index) const
+    {
+        return { paths.get(index),
+                 strings.get(game[index]),
+                 titles.get(title[index]),
+                 strings.get(composer[index]),
+                 strings.get(format[index]),
+                 collection[index],
+                 (flags[index] & HAS_METADATA) != 0 };
+    }
+
+    [[nodiscard]] int collectionOf(uint32_t index) const
+    {
+        return collection[index];
+    }
+
+    // Id of a game, composer or format string, -1 if not present
+    [[nodiscard]] int64_t findString(std::string_view s) const
+    {
+        return strings.find(s);
+    }
+    // Flags the game, composer and format strings that contain `needle`
+    [[nodiscard]] std::vector<bool> matchStrings(std::string_view needle) const
+    {
+        return strings.match(needle);
+    }
+    [[nodiscard]] uint32_t composerId(uint32_t index) const
+    {
+        return composer[index];
+    }
+    [[nodiscard]] uint32_t formatId(uint32_t index) const
+    {
+        return format[index];
+    }
+
+    // Index of song with the given path (without collection), -1 if not found
+    [[nodiscard]] int64_t findPath(std::string_view path) const;
+
+    // Screenshots of the product that best matches a song, precomputed at
+    // import time. Full URLs separated by ';'
+    [[nodiscard]] std::string_view screenshots(uint32_t index) const
+    {
+        return shots.get(screenshot[index]);
+    }
+    uint32_t addScreenshots(std::string_view s) { return shots.add(s, false); }
+    void setScreenshots(uint32_t index, uint32_t id) { screenshot[index] = id; }
+
+    // Song indexes of the given product (product ROWID)
+    template <typename FN>
+    void forProductSongs(uint32_t product, FN const& f) const
+    {
+        if (product + 1 >= productStart.size()) return;
+        for (auto i = productStart[product]; i < productStart[product + 1]; i++)
+            f(productSongs[i]);
+    }
+
+    void dump(apone::File& f, uint16_t version) const;
+    // Returns false if the file was written for another database version
+    bool load(apone::File& f, uint16_t version);
+
+private:
+    static constexpr uint8_t HAS_METADATA = 1;
+    // Bump when the file layout changes
+    static constexpr uint16_t FILE_FORMAT = 2;
+
+    StringPool paths;
+    StringPool titles;
+    // Game, composer and format strings, dictionary encoded
+    StringPool strings;
+
+    std::vector<uint32_t> game;
+    std::vector<uint32_t> title;
+    std::vector<uint32_t> composer;
+    std::vector<uint32_t> format;
+    std::vector<uint16_t> collection;
+    std::vector<uint8_t> flags;
+
+    std::vector<uint32_t> productStart;
+    std::vector<uint32_t> productSongs;
+
+    // Shot list 0 is always the empty string
+    StringPool shots;
+    std::vector<uint32_t> screenshot;
+
+    // Path hashes sorted, and the song index of each
+    std::vector<uint64_t> pathHashes;
+    std::vector<uint32_t> pathIndexes;
+};
+
+} // namespace chipmachine
+
+#endif // SONG_STORE_H
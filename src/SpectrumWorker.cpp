@@ -0,0 +1,181 @@
+#include "SpectrumWorker.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#ifdef __SSE__
+#    include <xmmintrin.h>
+#endif
+
+namespace chipmachine {
+
+static constexpr double PI = 3.14159265358979323846;
+
+// Lowest and highest band edges, in Hz
+static constexpr double LowHz = 40;
+static constexpr double HighHz = 16000;
+
+// In-place radix 2 FFT on separate real and imaginary arrays, with the
+// twiddles of each stage stored contiguously so the butterflies vectorize.
+class Fft
+{
+public:
+    explicit Fft(int n) : n(n), reversed(n), wr(n), wi(n), window(n)
+    {
+        int bits = 0;
+        while ((1 << bits) < n)
+            bits++;
+        for (int i = 0; i < n; i++) {
+            int r = 0;
+            for (int b = 0; b < bits; b++)
+                r |= ((i >> b) & 1) << (bits - 1 - b);
+            reversed[i] = r;
+        }
+        // Stage with half size `h` uses entries h-1 .. 2h-2
+        for (int h = 1; h < n; h *= 2) {
+            for (int k = 0; k < h; k++) {
+                wr[h - 1 + k] = (float)std::cos(-PI * k / h);
+                wi[h - 1 + k] = (float)std::sin(-PI * k / h);
+            }
+        }
+        // Hann
+        for (int i = 0; i < n; i++)
+            window[i] = (float)(0.5 - 0.5 * std::cos(2 * PI * i / (n - 1)));
+    }
+
+    // Window `in`, transform it and write magnitudes of the first n/2 bins
+    void magnitudes(float const* in, float* out)
+    {
+        re.resize(n);
+        im.assign(n, 0.0F);
+        for (int i = 0; i < n; i++)
+            re[reversed[i]] = in[i] * window[i];
+        transform(re.data(), im.data());
+        for (int i = 0; i < n / 2; i++)
+            out[i] = std::sqrt(re[i] * re[i] + im[i] * im[i]);
+    }
+
+private:
+    void transform(float* xr, float* xi) const
+    {
+        for (int h = 1; h < n; h *= 2) {
+            float const* cr = &wr[h - 1];
+            float const* ci = &wi[h - 1];
+            for (int i = 0; i < n; i += 2 * h) {
+                float* ar = xr + i;
+                float* ai = xi + i;
+                float* br = ar + h;
+                float* bi = ai + h;
+                int k = 0;
+#ifdef __SSE__
+                for (; k + 4 <= h; k += 4) {
+                    __m128 c = _mm_loadu_ps(cr + k);
+                    __m128 s = _mm_loadu_ps(ci + k);
+                    __m128 r = _mm_loadu_ps(br + k);
+                    __m128 m = _mm_loadu_ps(bi + k);
+                    __m128 tr = _mm_sub_ps(_mm_mul_ps(r, c), _mm_mul_ps(m, s));
+                    __m128 ti = _mm_add_ps(_mm_mul_ps(r, s), _mm_mul_ps(m, c));
+                    __m128 x = _mm_loadu_ps(ar + k);
+                    __m128 y = _mm_loadu_ps(ai + k);
+                    _mm_storeu_ps(ar + k, _mm_add_ps(x, tr));
+                    _mm_storeu_ps(ai + k, _mm_add_ps(y, ti));
+                    _mm_storeu_ps(br + k, _mm_sub_ps(x, tr));
+                    _mm_storeu_ps(bi + k, _mm_sub_ps(y, ti));
+                }
+#endif
+                for (; k < h; k++) {
+                    float tr = br[k] * cr[k] - bi[k] * ci[k];
+                    float ti = br[k] * ci[k] + bi[k] * cr[k];
+                    br[k] = ar[k] - tr;
+                    bi[k] = ai[k] - ti;
+                    ar[k] += tr;
+                    ai[k] += ti;
+                }
+            }
+        }
+    }
+
+    int n;
+    std::vector<int> reversed;
+    std::vector<float> wr;
+    std::vector<float> wi;
+    std::vector<float> window;
+    std::vector<float> re;
+    std::vector<float> im;
+};
+
+SpectrumWorker::SpectrumWorker(int hz) : hz(hz), tap(32768)
+{
+    worker = std::thread([this] { run(); });
+}
+
+SpectrumWorker::~SpectrumWorker()
+{
+    {
+        std::lock_guard lock{ quitMutex };
+        quit = true;
+    }
+    quitCond.notify_one();
+    worker.join();
+}
+
+void SpectrumWorker::addAudio(int16_t const* samples, int count)
+{
+    tap.put(samples, count);
+}
+
+bool SpectrumWorker::getLevels(Levels& out)
+{
+    if (!levels.update()) return false;
+    out = levels.front();
+    return true;
+}
+
+SpectrumWorker::Levels SpectrumWorker::analyze(float const* mono, int hz)
+{
+    thread_local Fft fft{ FftSize };
+    thread_local std::vector<float> mags(FftSize / 2);
+    fft.magnitudes(mono, mags.data());
+
+    // A full scale sine peaks at FftSize / 4 after the Hann window
+    constexpr float FullScale = 32767.0F * FftSize / 4;
+    double high = std::min(HighHz, hz / 2.0);
+    Levels result{};
+    int first = 1;
+    for (int b = 0; b < eq_slots; b++) {
+        double edge = LowHz * std::pow(high / LowHz, (b + 1.0) / eq_slots);
+        int last = std::clamp((int)(edge * FftSize / hz), first, FftSize / 2);
+        float peak = 0;
+        for (int i = first; i < last; i++)
+            peak = std::max(peak, mags[i]);
+        first = last;
+        // 64 steps per e, so the bars cover 4 e-folds (about 35 dB)
+        auto f = 255 + 64 * std::log(std::max(peak / FullScale, 1e-9F));
+        result[b] = (uint8_t)std::clamp(f, 0.0F, 255.0F);
+    }
+    return result;
+}
+
+void SpectrumWorker::run()
+{
+    std::vector<int16_t> in(tap.size());
+    // Last `FftSize` frames, downmixed to mono
+    std::vector<float> history(FftSize, 0.0F);
+    std::unique_lock lock{ quitMutex };
+    while (!quit) {
+        quitCond.wait_for(lock, std::chrono::milliseconds(10));
+        auto count = tap.get(in.data(), in.size()) & ~1U;
+        if (count == 0) continue;
+        auto frames = std::min<int>(count / 2, FftSize);
+        int16_t const* src = in.data() + count - frames * 2;
+        std::move(history.begin() + frames, history.end(), history.begin());
+        float* dst = &history[FftSize - frames];
+        for (int i = 0; i < frames; i++)
+            dst[i] = (src[i * 2] + src[i * 2 + 1]) * 0.5F;
+        levels.back() = analyze(history.data(), hz);
+        levels.publish();
+    }
+}
+
+} // namespace chipmachine
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "AudioRing.h"
+#include "TripleBuffer.h"
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace chipmachine {
+
+// Computes the spectrum bars on a thread of its own. The audio callback only
+// copies samples into a ring; the worker runs the FFT and hands the levels
+// to the renderer through a triple buffer, so neither side ever waits.
+class SpectrumWorker
+{
+public:
+    static constexpr int eq_slots = 24;
+    // 0-255, log scale
+    using Levels = std::array<uint8_t, eq_slots>;
+
+    explicit SpectrumWorker(int hz = 44100);
+    ~SpectrumWorker();
+    SpectrumWorker(SpectrumWorker const&) = delete;
+
+    // Audio thread; interleaved stereo. Drops samples if the worker is
+    // behind.
+    void addAudio(int16_t const* samples, int count);
+
+    // Render thread; fills `levels` and returns true if new levels are
+    // available
+    bool getLevels(Levels& levels);
+
+    // Analyse one window of mono samples; `FftSize` values are read
+    static Levels analyze(float const* mono, int hz);
+
+    static constexpr int FftSize = 2048;
+
+private:
+    void run();
+
+    int hz;
+    AudioRing<int16_t> tap;
+    TripleBuffer<Levels> levels;
+
+    std::mutex quitMutex;
+    std::condition_variable quitCond;
+    bool quit = false;
+    std::thread worker;
+};
+
+} // namespace chipmachine
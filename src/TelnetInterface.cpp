@@ -107,15 +107,15 @@ void TelnetInterface::runClient(shared_ptr<Console> console)
 
     lip.registerFunction("play_file", [&](const std::string& path) {
         SongInfo song(path);
-        player.playSong(song);
+        player.playSong(song).wait();
     });
 
     lip.registerFunction("play_song", [&](const strmap& s) {
         SongInfo song(s.at("path"), "", s.at("title"), s.at("composer"));
-        player.playSong(song);
+        player.playSong(song).wait();
     });
 
-    lip.registerFunction("next_song", [&]() { player.nextSong(); });
+    lip.registerFunction("next_song", [&]() { player.nextSong().wait(); });
 
     lip.registerFunction("get_playing_song", [&]() -> strmap {
         SongInfo song = player.getInfo();
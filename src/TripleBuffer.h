@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+
+namespace chipmachine {
+
+// Wait-free handoff of values from one writer thread to one reader thread.
+// The writer fills back() and calls publish(), the reader calls update() and
+// reads front(). Neither side ever blocks; the reader always sees the latest
+// complete value and older ones are simply dropped.
+template <typename T> class TripleBuffer
+{
+public:
+    TripleBuffer() = default;
+    TripleBuffer(TripleBuffer const&) = delete;
+
+    // Writer
+    T& back() { return slots[backIndex]; }
+
+    void publish()
+    {
+        backIndex =
+            middle.exchange(backIndex | Fresh, std::memory_order_acq_rel) &
+            IndexMask;
+    }
+
+    // Reader; returns true if a new value was published since last call
+    bool update()
+    {
+        if ((middle.load(std::memory_order_relaxed) & Fresh) == 0) {
+            return false;
+        }
+        frontIndex =
+            middle.exchange(frontIndex, std::memory_order_acq_rel) & IndexMask;
+        return true;
+    }
+
+    T const& front() const { return slots[frontIndex]; }
+
+private:
+    static constexpr int IndexMask = 3;
+    static constexpr int Fresh = 4;
+
+    T slots[3]{};
+    int backIndex = 0;
+    // Index of the spare slot, plus `Fresh` if it holds an unread value
+    std::atomic<int> middle{ 1 };
+    int frontIndex = 2;
+};
+
+} // namespace chipmachine
@@ -1,5 +1,9 @@
 #include "ChipInterface.h"
+#include "MusicDatabase.h"
 #include "MusicPlayer.h"
+#include "PluginRegistry.h"
+#include "RemoteLoader.h"
+#include "Renderer.h"
 #ifndef TEXTMODE_ONLY
 #    include "ChipMachine.h"
 #    include <grappix/grappix.h>
@@ -53,6 +57,11 @@ int main(int argc, char* argv[])
         int w = 960;
         int h = 540;
         int port = 12345;
+        int rate = 44100;
+        std::string resampler = "medium";
+        bool realtime = false;
+        int rt_priority = 10;
+        std::string rt_cpus;
         bool full_screen = false;
         bool telnet_server = false;
         bool only_headless = false;
@@ -84,10 +93,54 @@ int main(int argc, char* argv[])
     opts.add_option("-p,--port", options.port, "Port for telnet server", true);
     opts.add_flag("-K", options.only_headless,
                   "Only play if no keyboard is connected");
+    opts.add_option("--rate", options.rate, "Audio output rate", true);
+    opts.add_option("--resampler", options.resampler,
+                    "Resampler quality (fast, medium or best)", true);
+    opts.add_flag("--realtime", options.realtime,
+                  "Realtime scheduling and locked buffers for audio threads");
+    opts.add_option("--rt-priority", options.rt_priority,
+                    "SCHED_FIFO priority with --realtime", true);
+    opts.add_option("--rt-cpus", options.rt_cpus,
+                    "Cores for the audio threads with --realtime (eg 2,3)");
     opts.add_option("--play", options.play_what,
                     "Shuffle a named collection (also 'all' or 'favorites')");
     opts.add_option("files", options.songs, "Songs to play");
 
+    chipmachine::Renderer::Options render_options;
+    std::vector<std::string> render_files;
+    auto* render =
+        opts.add_subcommand("render", "Render songs to WAV files, as fast as "
+                                      "possible and without audio output");
+    render->add_option("-o,--out", render_options.outDir, "Output directory",
+                       true);
+    render->add_option("-t,--tune", render_options.tune, "Subsong to render");
+    render->add_flag("-a,--all-tunes", render_options.allTunes,
+                     "Render every subsong to its own file");
+    render->add_option("-s,--seconds", render_options.seconds,
+                       "Length of songs with unknown length", true);
+    render->add_flag("--raw", render_options.raw,
+                     "Write raw 16 bit stereo PCM instead of WAV");
+    render->add_option("-j,--jobs", render_options.jobs,
+                       "Songs rendered in parallel (default one per core)");
+    render->add_option("files", render_files, "Songs to render")->required();
+
+    chipmachine::Renderer::Options analyze_options;
+    analyze_options.analyze = true;
+    analyze_options.seconds = 600;
+    std::vector<std::string> analyze_files;
+    auto* analyze = opts.add_subcommand(
+        "analyze", "Find where songs end and store it in the database");
+    analyze->add_option("-t,--tune", analyze_options.tune,
+                        "Subsong to analyze");
+    analyze->add_flag("-a,--all-tunes", analyze_options.allTunes,
+                      "Analyze every subsong");
+    analyze->add_option("-s,--seconds", analyze_options.seconds,
+                        "Give up on songs that play longer", true);
+    analyze->add_option("-j,--jobs", analyze_options.jobs,
+                        "Songs analyzed in parallel (default one per core)");
+    analyze->add_option("files", analyze_files, "Songs to analyze")
+        ->required();
+
     CLI11_PARSE(opts, argc, argv)
 
     auto search_path = makeSearchPath(
@@ -113,7 +166,57 @@ int main(int argc, char* argv[])
 
     auto work_dir = data_dir->parent_path();
     musix::ChipPlugin::createPlugins(work_dir / "data");
-    AudioPlayer audio_player{ 44100 };
+
+    auto printStats = [](chipmachine::Renderer const& renderer) {
+        for (auto const& [plugin, stats] : renderer.getStats()) {
+            utils::print_fmt("%-16s %4d songs %4d failed %8.1fs audio "
+                             "%7.2fs render %6.1fx realtime\n",
+                             plugin, stats.songs, stats.failed,
+                             stats.audioSeconds, stats.cpuSeconds,
+                             stats.realtimeFactor());
+        }
+        auto probe = chipmachine::PluginRegistry::getStats();
+        utils::print_fmt("Plugin lookups: %d, %d probed all plugins, %.1fms\n",
+                         (int)probe.lookups, (int)probe.probes,
+                         probe.probeSeconds * 1000);
+    };
+
+    if (render->parsed()) {
+        render_options.hz = options.rate;
+        chipmachine::Renderer renderer{ render_options };
+        bool ok = renderer.render(render_files);
+        printStats(renderer);
+        return ok ? 0 : 1;
+    }
+
+    if (analyze->parsed()) {
+        chipmachine::Renderer renderer{ analyze_options };
+        bool ok = renderer.render(analyze_files);
+        chipmachine::RemoteLoader loader;
+        chipmachine::MusicDatabase mdb{ loader };
+        for (auto const& a : renderer.getAnalyses()) {
+            mdb.putAnalysis(a.file, a.tune, a.tunes, a.lengthMs);
+            if (a.lengthMs > 0)
+                utils::print_fmt("%s #%d: ends at %d:%02d.%03d\n", a.file,
+                                 a.tune, a.lengthMs / 60000,
+                                 a.lengthMs / 1000 % 60, a.lengthMs % 1000);
+            else if (a.lengthMs == chipmachine::Renderer::Analysis::Silent)
+                utils::print_fmt("%s #%d: silent\n", a.file, a.tune);
+            else
+                utils::print_fmt("%s #%d: never ends\n", a.file, a.tune);
+        }
+        printStats(renderer);
+        return ok ? 0 : 1;
+    }
+    chipmachine::MusicPlayer::setOutput(
+        options.rate,
+        chipmachine::Resampler::qualityFromName(options.resampler));
+    chipmachine::Realtime::Options rt;
+    rt.enabled = options.realtime;
+    rt.priority = options.rt_priority;
+    rt.cpus = chipmachine::Realtime::parseCpus(options.rt_cpus);
+    chipmachine::MusicPlayer::setRealtime(rt);
+    AudioPlayer audio_player{ options.rate };
     const auto injector =
         di::make_injector(di::bind<AudioPlayer>.to(audio_player),
                           di::bind<utils::path>.to(work_dir));
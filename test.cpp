@@ -1,5 +1,17 @@
 #include "catch.hpp"
 
+#include "src/AudioRing.h"
+#include "src/BufferTuner.h"
+#include "src/CommandQueue.h"
+#include "src/MemFile.h"
+#include "src/PcmCache.h"
+#include "src/PcmKernels.h"
+#include "src/PluginRegistry.h"
+#include "src/Realtime.h"
+#include "src/Resampler.h"
+#include "src/SeekCache.h"
+#include "src/SongStore.h"
+#include "src/SpectrumWorker.h"
 #include "src/MusicDatabase.h"
 #include "src/MusicPlayer.h"
 #include "src/MusicPlayerList.h"
@@ -16,8 +28,14 @@ namespace di = boost::di;
 
 #include <algorithm>
 #include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
 #include <numeric>
 #include <string>
+#include <thread>
+#include <vector>
 
 TEST_CASE("modutils", "[machine]")
 {
@@ -41,6 +59,344 @@ TEST_CASE("modutils", "[machine]")
                         "2fChris Huelsbeck%2fmdat.apidya (level 3)") == "mdat");
 }
 
+TEST_CASE("audioring", "[machine]")
+{
+    chipmachine::AudioRing<int16_t> ring(1000);
+    REQUIRE(ring.size() == 1024);
+
+    std::array<int16_t, 700> in{};
+    std::iota(in.begin(), in.end(), 0);
+    std::array<int16_t, 700> out{};
+
+    // Wrap around the end of the buffer
+    for (int i = 0; i < 3; i++) {
+        REQUIRE(ring.put(in.data(), in.size()) == 700);
+        REQUIRE(ring.left() == 1024 - 700);
+        REQUIRE(ring.put(in.data(), in.size()) == 1024 - 700);
+        REQUIRE(ring.get(out.data(), out.size()) == 700);
+        REQUIRE(out == in);
+        REQUIRE(ring.get(out.data(), out.size()) == 1024 - 700);
+        REQUIRE(ring.filled() == 0);
+    }
+
+    ring.put(in.data(), 100);
+    ring.clear();
+    ring.put(in.data() + 500, 10);
+    REQUIRE(ring.get(out.data(), out.size()) == 10);
+    REQUIRE(out[0] == 500);
+}
+
+TEST_CASE("buffertuner", "[machine]")
+{
+    using chipmachine::BufferTuner;
+    BufferTuner tuner;
+    // Cheap plugin: 1ms per 46ms chunk stays at the minimum
+    tuner.setPlugin("cheap");
+    for (int i = 0; i < 100; i++)
+        tuner.decoded(BufferTuner::ChunkFrames, 44100, 0.001);
+    REQUIRE(tuner.targetMs() == BufferTuner::MinMs);
+
+    // Heavy emulator with spikes gets deeper buffering
+    tuner.setPlugin("heavy");
+    for (int i = 0; i < 100; i++)
+        tuner.decoded(BufferTuner::ChunkFrames, 44100, i % 10 ? 0.02 : 0.08);
+    int heavy = tuner.targetMs();
+    REQUIRE(heavy > 200);
+    tuner.underrun();
+    REQUIRE(tuner.targetMs() > heavy);
+    REQUIRE(tuner.targetMs() <= BufferTuner::MaxMs);
+
+    // Learned values come back with the plugin
+    tuner.setPlugin("cheap");
+    REQUIRE(tuner.targetMs() == BufferTuner::MinMs);
+    tuner.setPlugin("heavy");
+    REQUIRE(tuner.stats().underruns == 1);
+    REQUIRE(BufferTuner::getStats().size() >= 2);
+
+    // The underrun boost decays after clean playback
+    int boosted = tuner.targetMs();
+    for (int i = 0; i < 44100 * 31 / BufferTuner::ChunkFrames; i++)
+        tuner.decoded(BufferTuner::ChunkFrames, 44100, 0.02);
+    REQUIRE(tuner.targetMs() < boosted);
+}
+
+TEST_CASE("commandqueue", "[machine]")
+{
+    chipmachine::CommandQueue queue;
+    std::vector<int> order;
+    std::thread producer([&] {
+        for (int i = 0; i < 1000; i++)
+            queue.push([&order, i] { order.push_back(i); });
+    });
+    producer.join();
+    REQUIRE(queue.run() == 1000);
+    REQUIRE(queue.run() == 0);
+    for (int i = 0; i < 1000; i++)
+        REQUIRE(order[i] == i);
+}
+
+TEST_CASE("resampler", "[machine]")
+{
+    for (auto q : { chipmachine::Resampler::Fast,
+                    chipmachine::Resampler::Best }) {
+        chipmachine::Resampler resampler;
+        resampler.setup(44100, 48000, q);
+        std::vector<int16_t> in(4410 * 2, 1000);
+        std::vector<int16_t> out;
+        for (int i = 0; i < 10; i++)
+            resampler.process(in.data(), in.size(), out);
+        // One second in, about one second out
+        REQUIRE(std::abs((int)out.size() / 2 - 48000) < 64);
+        // DC passes unchanged once the kernel is filled
+        REQUIRE(out[out.size() / 2] == 1000);
+    }
+
+    // A ramp stays a ramp; picking the nearest input instead would repeat
+    // values (steps of 0) when upsampling
+    for (auto q : { chipmachine::Resampler::Fast,
+                    chipmachine::Resampler::Medium,
+                    chipmachine::Resampler::Best }) {
+        chipmachine::Resampler resampler;
+        resampler.setup(44100, 48000, q);
+        std::vector<int16_t> in(10000 * 2);
+        for (size_t i = 0; i < in.size(); i++)
+            in[i] = (int16_t)(i / 2 * 3);
+        std::vector<int16_t> out;
+        resampler.process(in.data(), in.size(), out);
+        // 3 * 44100 / 48000 = 2.76 per output frame
+        for (size_t i = 200; i + 200 < out.size() / 2; i++) {
+            int step = out[i * 2] - out[i * 2 - 2];
+            REQUIRE(step >= 2);
+            REQUIRE(step <= 4);
+        }
+    }
+}
+
+TEST_CASE("spectrum", "[machine]")
+{
+    using chipmachine::SpectrumWorker;
+    std::vector<float> mono(SpectrumWorker::FftSize);
+    std::array<int, 2> hz{ 110, 3000 };
+    std::array<int, 2> bands{};
+    for (int t = 0; t < 2; t++) {
+        for (size_t i = 0; i < mono.size(); i++)
+            mono[i] = 16000 * std::sin(2 * 3.14159265 * hz[t] * i / 44100);
+        auto levels = SpectrumWorker::analyze(mono.data(), 44100);
+        auto peak = std::max_element(levels.begin(), levels.end());
+        REQUIRE(*peak > 200);
+        bands[t] = (int)(peak - levels.begin());
+    }
+    REQUIRE(bands[0] < bands[1]);
+
+    // Silence gives empty bars
+    std::fill(mono.begin(), mono.end(), 0.0F);
+    auto levels = SpectrumWorker::analyze(mono.data(), 44100);
+    REQUIRE(*std::max_element(levels.begin(), levels.end()) == 0);
+
+    // Levels reach the reader through the worker thread
+    SpectrumWorker worker;
+    std::vector<int16_t> audio(8192);
+    for (size_t i = 0; i < audio.size(); i++)
+        audio[i] = (int16_t)(16000 * std::sin(2 * 3.14159265 * 440 * (i / 2) /
+                                              44100));
+    worker.addAudio(audio.data(), audio.size());
+    SpectrumWorker::Levels got{};
+    for (int i = 0; i < 200 && !worker.getLevels(got); i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    REQUIRE(*std::max_element(got.begin(), got.end()) > 200);
+}
+
+TEST_CASE("seekcache", "[machine]")
+{
+    chipmachine::SeekCache cache;
+    std::vector<int16_t> in(44100 * 5);
+    for (size_t i = 0; i < in.size(); i++)
+        in[i] = (int16_t)(i * 37);
+    for (size_t i = 0; i < in.size(); i += 1000)
+        cache.append(i / 2, &in[i], std::min<int>(1000, in.size() - i));
+    REQUIRE(cache.end() == (int64_t)in.size() / 2);
+    REQUIRE(cache.compressedSize() > 0);
+
+    // Read back across block boundaries, including the pending block
+    std::vector<int16_t> out(in.size());
+    int64_t frame = 30000;
+    size_t pos = frame * 2;
+    while (pos < out.size()) {
+        int n = cache.read(frame, &out[pos], out.size() - pos);
+        REQUIRE(n > 0);
+        pos += n;
+        frame += n / 2;
+    }
+    REQUIRE(std::equal(in.begin() + 60000, in.end(), out.begin() + 60000));
+    REQUIRE(cache.read(frame, &out[0], 2) == 0);
+
+    // Audio that does not continue the cache is ignored
+    cache.append(0, &in[0], 100);
+    REQUIRE(cache.end() == (int64_t)in.size() / 2);
+}
+
+TEST_CASE("pcmcache", "[machine]")
+{
+    namespace fs = std::filesystem;
+    auto dir = fs::temp_directory_path() / "cmtest_pcm";
+    fs::remove_all(dir);
+    chipmachine::PcmCache cache{ dir.string() };
+    auto song = (dir / "song.sid").string();
+    REQUIRE(cache.record(song, 0) == nullptr);
+    cache.setBudget(1024 * 1024);
+
+    std::vector<int16_t> in(44100 * 3 + 100);
+    for (size_t i = 0; i < in.size(); i++)
+        in[i] = (int16_t)(i * 7);
+    {
+        auto rec = cache.record(song, 0);
+        rec->append(0, in.data(), in.size());
+        rec->commit();
+        // Not committed, so thrown away
+        cache.record(song, 1)->append(0, in.data(), 100);
+    }
+    // Written in the background
+    cache.flush();
+    REQUIRE(cache.open(song, 1) == nullptr);
+
+    auto cached = cache.open(song, 0);
+    REQUIRE(cached != nullptr);
+    REQUIRE(cached->frames() == (int64_t)in.size() / 2);
+    std::vector<int16_t> out;
+    std::vector<int16_t> buf(5000);
+    while (int n = cached->read(out.size() / 2, buf.data(), buf.size()))
+        out.insert(out.end(), buf.begin(), buf.begin() + n);
+    REQUIRE(out == in);
+
+    // Over budget, so it goes
+    cached = nullptr;
+    cache.setBudget(1);
+    REQUIRE(cache.open(song, 0) == nullptr);
+    fs::remove_all(dir);
+}
+
+TEST_CASE("pcmkernels", "[machine]")
+{
+    using chipmachine::PcmIsa;
+    std::vector<int16_t> in(1001 * 2);
+    for (size_t i = 0; i < in.size(); i++)
+        in[i] = (int16_t)((i * 7919) % 65536 - 32768);
+    // Quiet tail that is not a multiple of the vector width
+    for (size_t i = in.size() - 37; i < in.size(); i++)
+        in[i] = (int16_t)(i % 2 ? 15 : -15);
+
+    chipmachine::setPcmIsa(PcmIsa::Scalar);
+    auto ramped = in;
+    chipmachine::pcmGainRamp(ramped.data(), ramped.size(), 1.5F, 0.25F);
+    // Saturates instead of wrapping
+    REQUIRE(ramped[0] == -32768);
+    REQUIRE(ramped[1] == std::clamp((int)(in[1] * 1.5F), -32768, 32767));
+    REQUIRE(chipmachine::pcmTrailingQuiet(in.data(), in.size(), 16) == 37);
+    REQUIRE(chipmachine::pcmTrailingQuiet(in.data(), in.size(), 15) == 0);
+
+    for (auto isa : { PcmIsa::SSE2, PcmIsa::AVX2 }) {
+        if (chipmachine::setPcmIsa(isa) != isa) continue;
+        auto out = in;
+        chipmachine::pcmGainRamp(out.data(), out.size(), 1.5F, 0.25F);
+        for (size_t i = 0; i < out.size(); i++)
+            REQUIRE(std::abs(out[i] - ramped[i]) <= 1);
+        REQUIRE(chipmachine::pcmTrailingQuiet(in.data(), in.size(), 16) ==
+                37);
+        std::vector<int16_t> silent(100);
+        REQUIRE(chipmachine::pcmTrailingQuiet(silent.data(), 100, 16) == 100);
+    }
+    chipmachine::setPcmIsa(PcmIsa::AVX2);
+}
+
+// Run with `cmtest [.bench]`
+TEST_CASE("pcmkernels benchmark", "[.bench]")
+{
+    using chipmachine::PcmIsa;
+    // Same block size as the decoder uses
+    std::vector<int16_t> buf(8192);
+    for (size_t i = 0; i < buf.size(); i++)
+        buf[i] = (int16_t)((i * 7919) % 2048 - 1024);
+    auto quiet = buf;
+    std::fill(quiet.begin(), quiet.end(), 3);
+    int rounds = 20000;
+    for (auto isa : { PcmIsa::Scalar, PcmIsa::SSE2, PcmIsa::AVX2 }) {
+        if (chipmachine::setPcmIsa(isa) != isa) continue;
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < rounds; r++)
+            chipmachine::pcmGainRamp(buf.data(), buf.size(), 1.0F, 1.0F);
+        auto mid = std::chrono::steady_clock::now();
+        int total = 0;
+        for (int r = 0; r < rounds; r++)
+            total += chipmachine::pcmTrailingQuiet(quiet.data(), quiet.size(),
+                                                   16);
+        auto end = std::chrono::steady_clock::now();
+        std::chrono::duration<double, std::micro> ramp = mid - start;
+        std::chrono::duration<double, std::micro> scan = end - mid;
+        printf("%-6s ramp %.2fus  silence %.2fus  per %d samples\n",
+               chipmachine::pcmIsaName(isa), ramp.count() / rounds,
+               scan.count() / rounds, (int)buf.size());
+        REQUIRE(total == rounds * (int)quiet.size());
+    }
+    chipmachine::setPcmIsa(PcmIsa::AVX2);
+}
+
+TEST_CASE("realtime", "[machine]")
+{
+    using chipmachine::Realtime;
+    std::vector<int> cpus{ 1, 2, 3 };
+    REQUIRE(Realtime::parseCpus("3,1-2,x,2") == cpus);
+    REQUIRE(Realtime::parseCpus("").empty());
+    REQUIRE(Realtime::parseCpus("4-2").empty());
+
+    // Works or falls back, without privileges too
+    std::thread([] {
+        Realtime::Options options;
+        options.cpus = { 0 };
+        auto r = Realtime::applyToThread(options, 0);
+        REQUIRE(!r.describe().empty());
+        REQUIRE((r.policy == "SCHED_OTHER") == !r.error.empty());
+    }).join();
+}
+
+TEST_CASE("memfile", "[machine]")
+{
+    std::string path;
+    {
+        chipmachine::MemFile f{ "song.mod", { 1, 2, 3 } };
+        REQUIRE(f);
+        path = f.path();
+        REQUIRE(std::filesystem::file_size(path) == 3);
+        REQUIRE(utils::path_filename(path) == "song.mod");
+    }
+    REQUIRE(!std::filesystem::exists(path));
+
+    // Left by a process that is gone
+    auto root = chipmachine::MemFile::root();
+    if (root.parent_path() == "/dev/shm") {
+        auto stale = root.parent_path() / "chipmachine-2147483647";
+        std::filesystem::create_directories(stale / "0");
+        chipmachine::MemFile::removeStale();
+        REQUIRE(!std::filesystem::exists(stale));
+        REQUIRE(std::filesystem::exists(root));
+    }
+}
+
+TEST_CASE("stringpool", "[machine]")
+{
+    chipmachine::StringPool pool;
+    for (auto const* s : { "Hubbard", "Galway", "", "Tel", "Galway" })
+        pool.add(s);
+    REQUIRE(pool.size() == 4);
+    REQUIRE(pool.find("Galway") == 1);
+    // Searched through the sorted index once finished
+    pool.finish();
+    REQUIRE(pool.find("Galway") == 1);
+    REQUIRE(pool.find("") == 2);
+    REQUIRE(pool.find("Tel") == 3);
+    REQUIRE(pool.find("Gal") == -1);
+    REQUIRE(pool.find("Zzz") == -1);
+}
+
 TEST_CASE("music database", "[database]")
 {
     using namespace chipmachine;
@@ -85,6 +441,9 @@ TEST_CASE("musicplayerlist", "")
     mpl->addSong("music/Amiga/Dr.Awesome - Intromusic3.mod"s);
     mpl->nextSong();
     mpl->wait();
+    auto status = mpl->getStatus();
+    REQUIRE(status->version > 0);
+    REQUIRE(status->listSize == mpl->listSize());
     auto state = mpl->getState();
     auto info = mpl->getInfo();
     LOGI("%s %s %d", info.title, info.path, state);
@@ -110,6 +469,19 @@ TEST_CASE("musicplayer", "")
     REQUIRE(sum != 0);
 }
 
+TEST_CASE("pluginregistry", "")
+{
+    using chipmachine::PluginRegistry;
+    musix::ChipPlugin::createPlugins("data");
+    auto mod = PluginRegistry::candidates("music/Amiga/Nuke - Loader.mod");
+    REQUIRE(!mod.empty());
+    auto before = PluginRegistry::getStats();
+    // Same extension; answered from the tables
+    auto again = PluginRegistry::candidates("music/Amiga/Other.MOD", false);
+    REQUIRE(again == mod);
+    REQUIRE(PluginRegistry::getStats().probes == before.probes);
+}
+
 template <typename PLUGIN, typename... ARGS>
 bool testPlugin(std::string const& dir, std::string const& exclude,
                 const ARGS&... args)